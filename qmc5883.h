@@ -14,6 +14,9 @@
 #define QMC5883_CORE_H
 
 #include <linux/regmap.h>
+#include <linux/hrtimer.h>
+#include <linux/seqlock.h>
+#include <linux/workqueue.h>
 #include <linux/iio/iio.h>
 
 #define QMC5883_DATA_OUT_LSB_REGS	0X00
@@ -26,6 +29,254 @@
 #define QMC5883_RESERVED_REG		0x0C
 #define QMC5883_CHIP_ID_REG		0x0D
 
+/* Device status */
+#define QMC5883_DATA_READY			0x1
+#define QMC5883_OVERFLOW			0x2
+#define QMC5883_DATA_SKIPPED			0x4
+
+/* Mode configuration */
+#define QMC5883_MODE_STANDBY			0x00
+#define QMC5883_MODE_CONTINUOUS			0x01
+#define QMC5883_MODE_MASK			0x03
+
+/*
+ * Control register 2: INT_ENB is active low, i.e. writing 1 disables
+ * the DRDY interrupt pin.
+ */
+#define QMC5883_INT_DISABLE			0x01
+#define QMC5883_ROL_PNT				0x40
+#define QMC5883_SOFT_RST			0x80
+
+/*
+ * QMC5883: Minimum data output rate
+ */
+#define QMC5883_RATE_OFFSET			0x02
+#define QMC5883_RATE_DEFAULT			0x00
+#define QMC5883_RATE_MASK			0x0C
+
+#define QMC5883_RANGE_GAIN_OFFSET		0x04
+#define QMC5883_RANGE_GAIN_DEFAULT		0x00
+#define QMC5883_RANGE_GAIN_MASK			0x30
+
+#define QMC5883_OVERSAMPLING_OFFSET		0x06
+#define QMC5883_OVERSAMPLING_DEFAULT		0x00
+#define QMC5883_OVERSAMPLING_MASK		0xC0
+
+/**
+ * struct qmc5883_config - decoded copy of the configuration registers
+ * @mode:		QMC5883_MODE_* of CONTROL_REG_1
+ * @odr:		data output rate, index of the ODR field
+ * @range:		full scale range, index of the RNG field
+ * @osr:		over sample ratio, index of the OSR field
+ * @int_enabled:	DRDY pin enabled, i.e. INT_ENB cleared
+ * @rollover:		ROL_PNT set in CONTROL_REG_2
+ * @set_reset_period:	PERIOD register
+ */
+struct qmc5883_config {
+	u8 mode;
+	u8 odr;
+	u8 range;
+	u8 osr;
+	bool int_enabled;
+	bool rollover;
+	u8 set_reset_period;
+};
+
+/**
+ * struct qmc5883_sample - latest sample read from the chip
+ * @axes:		X, Y and Z readings of the same measurement
+ * @vec:		@axes after the enabled processing stages
+ * @temp:		temperature reading
+ * @status:		status register read along with the data
+ * @seq:		incremented on every new sample
+ * @stamp_ns:		monotonic time of the read, 0 if invalid
+ */
+struct qmc5883_sample {
+	s16 axes[3];
+	s32 vec[3];
+	s16 temp;
+	u8 status;
+	u64 seq;
+	u64 stamp_ns;
+};
+
+/*
+ * Scan layout handed to iio_push_to_buffers_with_timestamp(). Channels
+ * keep the chip's little-endian register format, so they are filled
+ * straight from the burst and consumers can use them without swapping.
+ */
+struct qmc5883_scan {
+	__le16 chans[3];
+	__le16 temp;
+	__le16 heading;
+	s64 timestamp __aligned(8);
+};
+
+/* Calibration and rotation coefficients are Q16, inputs are bounded */
+#define QMC5883_CALIB_SHIFT	16
+#define QMC5883_CALIB_MAX	16
+
+/**
+ * struct qmc5883_calib - hard and soft iron correction of buffered samples
+ * @bias:		calibbias per axis in LSB, added to the raw reading
+ * @scale:		calibscale per axis in micro units
+ * @soft_iron:		soft iron matrix in micro units, row major
+ * @coef:		@scale times @soft_iron in Q16, used by the push path
+ */
+struct qmc5883_calib {
+	int bias[3];
+	int scale[3];
+	int soft_iron[9];
+	s32 coef[9];
+};
+
+/**
+ * struct qmc5883_rotation - mount matrix in a form the push path applies
+ * @coef:		mount matrix in Q16, row major
+ * @src:		input axis feeding each output axis, if @permute
+ * @sign:		+1 or -1 per output axis, if @permute
+ * @permute:		the matrix only swaps axes and flips signs
+ */
+struct qmc5883_rotation {
+	s32 coef[9];
+	u8 src[3];
+	s8 sign[3];
+	bool permute;
+};
+
+#define QMC5883_FILTER_MAX_TAPS	64
+#define QMC5883_DECIMATION_MAX	200
+
+enum qmc5883_filter_type {
+	QMC5883_FILTER_MOVING_AVERAGE,
+	QMC5883_FILTER_IIR,
+};
+
+/**
+ * struct qmc5883_filter - low-pass and decimation of buffered samples
+ * @type:		enum qmc5883_filter_type
+ * @cutoff_uhz:		-3 dB frequency in micro Hz, 0 bypasses the filter
+ * @odr:		sampling frequency @taps and @alpha were derived for
+ * @taps:		moving average length
+ * @alpha:		IIR coefficient in Q16
+ * @hist:		moving average history
+ * @sum:		running sum of @hist
+ * @pos:		next slot of @hist
+ * @fill:		valid entries of @hist, non-zero once @state is primed
+ * @state:		IIR output, shifted left by 8
+ */
+struct qmc5883_filter {
+	enum qmc5883_filter_type type;
+	unsigned int cutoff_uhz;
+	unsigned int odr;
+	unsigned int taps;
+	u32 alpha;
+	s32 hist[QMC5883_FILTER_MAX_TAPS][3];
+	s32 sum[3];
+	unsigned int pos;
+	unsigned int fill;
+	s64 state[3];
+};
+
+/**
+ * struct qmc5883_decimator - per buffer decimation
+ * @factor:		push one out of this many samples
+ * @count:		samples since the last pushed one
+ */
+struct qmc5883_decimator {
+	unsigned int factor;
+	unsigned int count;
+};
+
+/* Event slots, the per-axis ones take the axis index as argument */
+#define QMC5883_EV_RISING(axis)		(axis)
+#define QMC5883_EV_FALLING(axis)	(3 + (axis))
+#define QMC5883_EV_ROC(axis)		(6 + (axis))
+#define QMC5883_EV_MAG			9
+#define QMC5883_EV_OVERFLOW		10
+#define QMC5883_EV_RANGE		11
+#define QMC5883_EV_COUNT		12
+
+/**
+ * struct qmc5883_events - events evaluated on every buffered sample
+ * @value:		threshold of each QMC5883_EV_* slot, LSB or LSB/s
+ * @enabled:		bitmap of enabled slots
+ * @active:		slots whose condition held on the last sample, so a
+ * 			threshold fires once per crossing instead of per sample
+ * @prev:		last vector, for the rate of change
+ * @mag_ref:		vector magnitude when the last magnitude event fired
+ * @primed:		@prev and @mag_ref hold a sample
+ */
+struct qmc5883_events {
+	int value[QMC5883_EV_COUNT];
+	unsigned long enabled;
+	unsigned long active;
+	s32 prev[3];
+	u32 mag_ref;
+	bool primed;
+};
+
+/**
+ * struct qmc5883_autorange - automatic full scale selection
+ * @enabled:		switch between the 2G and 8G ranges on its own
+ * @overflows:		consecutive overflowed samples in the 2G range
+ * @quiet:		consecutive samples in the 8G range that fit 2G
+ * @settle:		drop the next sample, it may predate the switch
+ */
+struct qmc5883_autorange {
+	bool enabled;
+	unsigned int overflows;
+	unsigned int quiet;
+	bool settle;
+};
+
+/* Processing stages applied to buffered samples, see qmc5883_fill_scan() */
+#define QMC5883_PROC_CALIB	BIT(0)
+#define QMC5883_PROC_ROTATE	BIT(1)
+
+/* Depth of the software FIFO emulated in the driver */
+#define QMC5883_FIFO_DEPTH	32
+
+#define QMC5883_STATS_BUCKETS	24
+
+/**
+ * struct qmc5883_stats - always-on counters exported through debugfs
+ * @samples:		new samples read from the chip
+ * @pushed:		samples handed to the IIO buffer
+ * @transfers:		bus transfers issued for samples
+ * @bytes:		bytes read by those transfers
+ * @skipped:		samples with DOR set, i.e. a conversion was lost
+ * @overflow:		samples with OVL set, i.e. an axis saturated
+ * @range_switches:	full scale changes made by auto-ranging
+ * @latency_hist:	log2 histogram of trigger to push latency in us
+ * @polls_hist:		log2 histogram of bursts per sample read
+ */
+struct qmc5883_stats {
+	atomic64_t samples;
+	atomic64_t pushed;
+	atomic64_t transfers;
+	atomic64_t bytes;
+	atomic64_t skipped;
+	atomic64_t overflow;
+	atomic64_t range_switches;
+	atomic64_t latency_hist[QMC5883_STATS_BUCKETS];
+	atomic64_t polls_hist[QMC5883_STATS_BUCKETS];
+};
+
+/* Extra buffers fed from the samples of the main one */
+#define QMC5883_MAX_TAPS	4
+
+struct qmc5883_data;
+
+/**
+ * struct qmc5883_tap - private data of an extra buffer device
+ * @data:		device the samples come from
+ * @decim:		decimation of this buffer
+ */
+struct qmc5883_tap {
+	struct qmc5883_data *data;
+	struct qmc5883_decimator decim;
+};
 
 enum qmc5883_ids {
 	QMC5883_ID,
@@ -34,23 +285,94 @@ enum qmc5883_ids {
 /**
  * struct qmc5883_data	- device specific data
  * @dev:		actual device
- * @lock:		update and read regmap data
+ * @lock:		serializes configuration updates
+ * @read_lock:		serializes sample producers, held across bus polling,
+ * 			and updates of the processing state they apply
+ * @sample_lock:	seqlock publishing @sample to lock-free readers
  * regmap:		hardware access register maps
  * @variant:		describe chip variants
- * @scan:		buffer to pack data for passing to
+ * @config:		configuration as last written, read without regmap
+ * @sample:		latest sample, serves sysfs reads while fresh
+ * @sample_max_age_ms:	how long @sample may be served without a bus read
+ * @irq:		DRDY interrupt line, <= 0 when not wired
+ * @drdy_trig:		trigger fired by the DRDY interrupt
+ * @timer_trig:		ODR locked timer trigger used without DRDY
+ * @timer:		hrtimer behind @timer_trig
+ * @timer_enabled:	@timer_trig is attached to the buffer
+ * @timer_period_ns:	period of @timer, one conversion
+ * @timer_skew_ns:	delay added to the next fire after a missed sample
+ * @conv_epoch_ns:	when conversions (re)started, anchors @timer phase
+ * @trig_ts:		time of the last fire of @drdy_trig or @timer_trig,
+ * 			shared by every buffer polled by that fire
+ * @scan:		latest processed sample, copied out for
  * 			iio_push_to_buffers_with_timestamp()
+ * @scan_ts:		@trig_ts @scan was produced for, 0 if not from our
+ * 			own triggers
+ * @scan_valid:		@scan holds a sample to push
+ * @streams:		buffers enabled, main and taps
+ * @own_streams:	enabled buffers on the DRDY or timer trigger
+ * @heading_streams:	enabled buffers that scan the heading
+ * @decim:		decimation of the main buffer
+ * @taps:		extra buffer devices
+ * @n_taps:		number of @taps
+ * @calib:		hard and soft iron correction
+ * @rotation:		@orientation precomputed for QMC5883_PROC_ROTATE
+ * @filter:		low-pass stage
+ * @events:		threshold, rate of change and magnitude events
+ * @autorange:		full scale selection from OVL and signal level
+ * @proc_flags:		QMC5883_PROC_* stages enabled for buffered samples
+ * @fifo_lock:		protects the software FIFO below
+ * @fifo:		samples held back until the watermark is reached
+ * @fifo_count:		number of samples in @fifo
+ * @fifo_watermark:	samples per push, 1 disables batching
+ * @fifo_timeout_ms:	flush a partial batch this long after its first
+ * 			sample, 0 waits for the watermark
+ * @fifo_work:		runs the @fifo_timeout_ms flush
+ * @stats:		sample path counters for debugfs
  *
  */
 struct qmc5883_data {
 	struct device *dev;
 	struct mutex lock;
+	struct mutex read_lock;
+	seqlock_t sample_lock;
 	struct regmap *regmap;
 	const struct qmc5883_chip_info *variant;
+	struct qmc5883_config config;
+	struct qmc5883_sample sample;
+	unsigned int sample_max_age_ms;
+	int irq;
+	struct iio_trigger *drdy_trig;
+	struct iio_trigger *timer_trig;
+	struct hrtimer timer;
+	bool timer_enabled;
+	u64 timer_period_ns;
+	atomic64_t timer_skew_ns;
+	u64 conv_epoch_ns;
+	s64 trig_ts;
 	struct iio_mount_matrix orientation;
-	struct {
-		__be16 chans[3];
-		s64 timestamp __aligned(8);
-	} scan;
+	struct qmc5883_scan scan;
+	s64 scan_ts;
+	bool scan_valid;
+	unsigned int streams;
+	unsigned int own_streams;
+	unsigned int heading_streams;
+	struct qmc5883_decimator decim;
+	struct iio_dev *taps[QMC5883_MAX_TAPS];
+	unsigned int n_taps;
+	struct qmc5883_calib calib;
+	struct qmc5883_rotation rotation;
+	struct qmc5883_filter filter;
+	struct qmc5883_events events;
+	struct qmc5883_autorange autorange;
+	unsigned long proc_flags;
+	struct mutex fifo_lock;
+	struct qmc5883_scan fifo[QMC5883_FIFO_DEPTH];
+	unsigned int fifo_count;
+	unsigned int fifo_watermark;
+	unsigned int fifo_timeout_ms;
+	struct delayed_work fifo_work;
+	struct qmc5883_stats stats;
 };
 
 int qmc5883_common_probe(struct device *dev, struct regmap *regmap,
@@ -59,13 +381,18 @@ void qmc5883_common_remove(struct device *dev);
 
 int qmc5883_common_suspend(struct device *dev);
 int qmc5883_common_resume(struct device *dev);
+int qmc5883_common_runtime_suspend(struct device *dev);
+int qmc5883_common_runtime_resume(struct device *dev);
 
 
 
-#ifdef CONFIG_PM_SLEEP
-static __maybe_unused SIMPLE_DEV_PM_OPS(qmc5883_pm_ops,
-					qmc5883_common_suspend,
-					qmc5883_common_resume);
+#ifdef CONFIG_PM
+static __maybe_unused const struct dev_pm_ops qmc5883_pm_ops = {
+	SET_SYSTEM_SLEEP_PM_OPS(qmc5883_common_suspend,
+				qmc5883_common_resume)
+	SET_RUNTIME_PM_OPS(qmc5883_common_runtime_suspend,
+			qmc5883_common_runtime_resume, NULL)
+};
 #define QMC5883_PM_OPS (&qmc5883_pm_ops)
 #else
 #define QMC5883_PM_OPS	NULL
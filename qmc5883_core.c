@@ -22,35 +22,70 @@
 #include <linux/regmap.h>
 #include <linux/iio/iio.h>
 #include <linux/iio/sysfs.h>
+#include <linux/iio/trigger.h>
 #include <linux/iio/trigger_consumer.h>
 #include <linux/iio/buffer.h>
+#include <linux/iio/events.h>
 #include <linux/iio/triggered_buffer.h>
+#include <linux/interrupt.h>
+#include <linux/of_irq.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <linux/of.h>
+#include <linux/pm_runtime.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
+#include <asm/unaligned.h>
 
 #include "qmc5883.h"
 
-/* Device status */
-#define QMC5883_DATA_READY			0x1
+#define CREATE_TRACE_POINTS
+#include "qmc5883_trace.h"
 
-/* Mode configuration */
-#define QMC5883_MODE_STANDBY			0x00
-#define QMC5883_MODE_CONTINUOUS			0x01
-#define QMC5883_MODE_MASK			0x03
+/*
+ * Burst read of XYZ, STATUS and TEMP (registers 0x00 - 0x08). This needs
+ * the roll-over pointer disabled, otherwise the address wraps back to
+ * 0x00 after the status register.
+ */
+#define QMC5883_BURST_LEN			9
+#define QMC5883_BURST_STATUS			6
+#define QMC5883_BURST_TEMP			7
+
+/* 100 LSB/degC, only the gain is trimmed so readings are relative */
+#define QMC5883_TEMP_SCALE_MILLI		10
+#define QMC5883_TEMP_OFFSET			0
+
+/* Heading is a binary angle, 0x10000 is a full turn: 2 * pi / 65536 rad */
+#define QMC5883_HEADING_SCALE_NANO		95874
+#define QMC5883_SCAN_HEADING			4
 
 /*
- * QMC5883: Minimum data output rate
+ * The internal timer trigger fires this long after the expected end of a
+ * conversion. A fire that still finds no data pushes the following ones
+ * back by 1/QMC5883_HRTIMER_SKEW_DIV of a period.
  */
-#define QMC5883_RATE_OFFSET			0x02
-#define QMC5883_RATE_DEFAULT			0x00
-#define QMC5883_RATE_MASK			0x0C
+#define QMC5883_HRTIMER_PHASE_NS		(500 * NSEC_PER_USEC)
+#define QMC5883_HRTIMER_SKEW_DIV		8
 
-#define QMC5883_RANGE_GAIN_OFFSET		0x04
-#define QMC5883_RANGE_GAIN_DEFAULT		0x00
-#define QMC5883_RANGE_GAIN_MASK			0x30
+/* Recommended SET/RESET period, see datasheet section 9.2.4 */
+#define QMC5883_SET_RESET_PERIOD_DEFAULT	0x01
+
+#define QMC5883_AUTOSUSPEND_DELAY_MS		2000
+
+/*
+ * Auto-ranging steps up to 8G after this many overflowed samples and
+ * back down to 2G once this many samples stay within 3/4 of the 2G
+ * range, i.e. 1.5G or 4500 LSB at 8G.
+ */
+#define QMC5883_AUTORANGE_OVL_SAMPLES		2
+#define QMC5883_AUTORANGE_LOW_SAMPLES		32
+#define QMC5883_AUTORANGE_LOW_LSB		4500
+#define QMC5883_RANGE_2G			0
+#define QMC5883_RANGE_8G			1
 
-#define QMC5883_OVERSAMPLING_OFFSET		0x06
-#define QMC5883_OVERSAMPLING_DEFAULT		0x00
-#define QMC5883_OVERSAMPLING_MASK		0xC0
+/* How long a cached sample may serve sysfs reads, one period at 10 Hz */
+#define QMC5883_SAMPLE_MAX_AGE_DEFAULT_MS	100
 
 /* 
  * From datasheet:
@@ -85,396 +120,1873 @@ static const int qmc5883_regval_to_oversampling_ratio[][2] = {
 /* 
  * From datasheet:
  * Value		/ QMC5883
- * 			/ Full Scale
- * 0			/ 2G
- * 1			/ 8G
+ * 			/ Full Scale	/ Sensitivity
+ * 0			/ 2G		/ 12000 LSB/G
+ * 1			/ 8G		/ 3000 LSB/G
+ *
+ * Kept as the IIO_VAL_FRACTIONAL scale in gauss per LSB.
  */
 
-static const int qmc5883_regval_to_full_scale[] = {
-	2, 8
+static const int qmc5883_regval_to_scale[][2] = {
+	{1, 12000}, {1, 3000}
+};
+
+/* atan(i / 64) for i = 0..64 as a binary angle, 8192 is 45 degrees */
+static const u16 qmc5883_atan_tbl[] = {
+	0, 163, 326, 489, 651, 813, 975, 1136,
+	1297, 1457, 1617, 1775, 1933, 2090, 2246, 2401,
+	2555, 2708, 2860, 3010, 3159, 3307, 3453, 3599,
+	3742, 3884, 4025, 4164, 4302, 4438, 4572, 4705,
+	4836, 4966, 5094, 5220, 5344, 5467, 5589, 5708,
+	5826, 5943, 6058, 6171, 6282, 6392, 6500, 6607,
+	6712, 6815, 6917, 7018, 7117, 7214, 7310, 7405,
+	7498, 7589, 7679, 7768, 7856, 7942, 8026, 8110,
+	8192,
 };
 
 /* Describe chip varints */
 struct qmc5883_chip_info {
 	const struct iio_chan_spec *channels;
+	const int n_channels;
 	const int (*regval_to_samp_freq)[2];
 	const int n_regval_to_samp_freq;
 	const int (*regval_to_oversampling_ratio)[2];
 	const int n_regval_to_oversampling_ratio;
-	const int *regval_to_full_scale;
-	const int n_regval_to_full_scale;
+	const int (*regval_to_scale)[2];
+	const int n_regval_to_scale;
 };
 
-static s32 qmc5883_set_mode(struct qmc5883_data *data, u8 operating_mode)
+static unsigned int qmc5883_odr_hz(struct qmc5883_data *data)
 {
-	int ret = 0;
-	int ret2, val;
+	unsigned int rval;
 
-	//Amar: TODO Remove below regmap_read and debug prints later
-	pr_info("qmc5883_set_mode++, oper_mode=%d\n", operating_mode);
-	ret2 = regmap_read(data->regmap, QMC5883_CONTROL_REG_1, &val);
-	pr_info("qmc5883_set_mode[1]: ctrl_reg1 = 0x%x \n", val);
+	rval = READ_ONCE(data->config.odr);
 
+	return data->variant->regval_to_samp_freq[rval][0];
+}
 
-	mutex_lock(&data->lock);
-	ret = regmap_update_bits(data->regmap, QMC5883_CONTROL_REG_1,
-				QMC5883_MODE_MASK, operating_mode);
-	mutex_unlock(&data->lock);
+static u64 qmc5883_odr_period_ns(struct qmc5883_data *data)
+{
+	return NSEC_PER_SEC / qmc5883_odr_hz(data);
+}
+
+/*
+ * (Re)start the internal trigger timer on the first conversion boundary
+ * still ahead of us, plus a small phase so the data is ready when it
+ * fires. Called with data->lock held.
+ */
+static void qmc5883_hrtimer_arm(struct qmc5883_data *data)
+{
+	u64 period = qmc5883_odr_period_ns(data);
+	u64 now = ktime_get_ns();
+	u64 next = data->conv_epoch_ns;
+
+	hrtimer_cancel(&data->timer);
+
+	if (now >= next)
+		next += (div64_u64(now - next, period) + 1) * period;
+
+	data->timer_period_ns = period;
+	atomic64_set(&data->timer_skew_ns, 0);
+	hrtimer_start(&data->timer, ns_to_ktime(next + QMC5883_HRTIMER_PHASE_NS),
+		HRTIMER_MODE_ABS);
+}
+
+static u8 qmc5883_ctrl1(const struct qmc5883_config *cfg)
+{
+	return cfg->mode |
+		cfg->odr << QMC5883_RATE_OFFSET |
+		cfg->range << QMC5883_RANGE_GAIN_OFFSET |
+		cfg->osr << QMC5883_OVERSAMPLING_OFFSET;
+}
+
+static u8 qmc5883_ctrl2(const struct qmc5883_config *cfg)
+{
+	return (cfg->int_enabled ? 0 : QMC5883_INT_DISABLE) |
+		(cfg->rollover ? QMC5883_ROL_PNT : 0);
+}
+
+static int qmc5883_write_config_reg(struct qmc5883_data *data,
+				unsigned int reg, u8 val)
+{
+	int ret;
 
-	//Amar: TODO Remove below regmap_read and debug prints later
-	ret2 = regmap_read(data->regmap, QMC5883_CONTROL_REG_1, &val);
-	pr_info("qmc5883_set_mode[2]: ctrl_reg1 = 0x%x \n", val);
+	ret = regmap_write(data->regmap, reg, val);
+	trace_qmc5883_config(data->dev, reg, val, ret);
 
 	return ret;
 }
 
-static int qmc5883_wait_measurement(struct qmc5883_data *data)
+/*
+ * Move the chip to @cfg. Every field is known, so each register that
+ * changed goes out as one plain write with no read-modify-write, and
+ * readers use data->config without going through regmap. CONTROL_REG_1
+ * comes last as it (re)starts conversions. With @force all registers
+ * are written. Called with data->lock held.
+ */
+static int qmc5883_apply_config(struct qmc5883_data *data,
+				const struct qmc5883_config *cfg, bool force)
 {
-	int tries = 150;
-	unsigned int val;
+	struct qmc5883_config *cur = &data->config;
 	int ret;
 
-	pr_info("qmc5883_wait_measurement++\n");
+	if (force || qmc5883_ctrl2(cfg) != qmc5883_ctrl2(cur)) {
+		ret = qmc5883_write_config_reg(data, QMC5883_CONTROL_REG_2,
+					qmc5883_ctrl2(cfg));
+		if (ret < 0)
+			return ret;
+		cur->int_enabled = cfg->int_enabled;
+		cur->rollover = cfg->rollover;
+	}
 
-	while (tries-- > 0) {
-		ret = regmap_read(data->regmap, QMC5883_STATUS_REG, &val);
+	if (force || cfg->set_reset_period != cur->set_reset_period) {
+		ret = qmc5883_write_config_reg(data, QMC5883_PERIOD_REG,
+					cfg->set_reset_period);
 		if (ret < 0)
 			return ret;
-		if (val & QMC5883_DATA_READY)
-			break;
-		msleep(20);
+		cur->set_reset_period = cfg->set_reset_period;
 	}
 
-	if (tries < 0) {
-		dev_err(data->dev, "data not ready\n");
-		return -EIO;
+	if (force || qmc5883_ctrl1(cfg) != qmc5883_ctrl1(cur)) {
+		ret = qmc5883_write_config_reg(data, QMC5883_CONTROL_REG_1,
+					qmc5883_ctrl1(cfg));
+		if (ret < 0)
+			return ret;
+		WRITE_ONCE(cur->mode, cfg->mode);
+		WRITE_ONCE(cur->odr, cfg->odr);
+		WRITE_ONCE(cur->range, cfg->range);
+		WRITE_ONCE(cur->osr, cfg->osr);
+
+		/* conversions restart from here */
+		data->conv_epoch_ns = ktime_get_ns();
+		if (data->timer_enabled)
+			qmc5883_hrtimer_arm(data);
 	}
 
 	return 0;
 }
 
-static int qmc5883_read_measurement(struct qmc5883_data *data,
-				int idx, int *val)
+static s32 qmc5883_set_mode(struct qmc5883_data *data, u8 operating_mode)
 {
-	__le16 values[3];
+	struct qmc5883_config cfg;
 	int ret;
 
 	mutex_lock(&data->lock);
-	ret = qmc5883_wait_measurement(data);
-	if (ret < 0) {
-		mutex_unlock(&data->lock);
-		return ret;
-	}
-	ret = regmap_bulk_read(data->regmap, QMC5883_DATA_OUT_LSB_REGS,
-				values, sizeof(values));
+	cfg = data->config;
+	cfg.mode = operating_mode;
+	ret = qmc5883_apply_config(data, &cfg, false);
 	mutex_unlock(&data->lock);
 
-	if (ret < 0)
-		return ret;
-
-	//Amar: TODO: Remove below debug print code
-	pr_info("Amar: read_meas++\n");
+	return ret;
+}
 
-	for (ret = 0; ret < 3; ret++)
-		pr_info("values[%d] = %d\n", ret, sign_extend32(le16_to_cpu(values[ret]), 15));
+static int qmc5883_set_power_state(struct qmc5883_data *data, bool on)
+{
+	int ret;
 
-	*val = sign_extend32(le16_to_cpu(values[idx]), 15);
+	if (on) {
+		ret = pm_runtime_get_sync(data->dev);
+		if (ret < 0) {
+			pm_runtime_put_noidle(data->dev);
+			dev_err(data->dev, "failed to resume: %d\n", ret);
+			return ret;
+		}
+		return 0;
+	}
 
-	return IIO_VAL_INT;
+	pm_runtime_mark_last_busy(data->dev);
+	return pm_runtime_put_autosuspend(data->dev);
 }
 
-static const struct iio_mount_matrix *
-qmc5883_get_mount_matrix(const struct iio_dev *indio_dev,
-			const struct iio_chan_spec *chan)
+/* log2 bucket: 0 holds 0, bucket n holds [2^(n-1), 2^n) */
+static void qmc5883_stats_hist(atomic64_t *hist, u64 val)
 {
-	struct qmc5883_data *data = iio_priv(indio_dev);
+	int bucket = min_t(int, fls64(val), QMC5883_STATS_BUCKETS - 1);
 
-	return &data->orientation;
+	atomic64_inc(&hist[bucket]);
 }
 
-static const struct iio_chan_spec_ext_info qmc5883_ext_info[] = {
-	IIO_MOUNT_MATRIX(IIO_SHARED_BY_DIR, qmc5883_get_mount_matrix),
-	{ }
-};
+static void qmc5883_stats_transfer(struct qmc5883_data *data, size_t len)
+{
+	atomic64_inc(&data->stats.transfers);
+	atomic64_add(len, &data->stats.bytes);
+}
 
-static ssize_t qmc5883_show_samp_freq_avail(struct device *dev,
-				struct device_attribute *attr, char *buf)
+/* Latency from the trigger timestamp to the hand over to the buffer */
+static void qmc5883_stats_push(struct qmc5883_data *data, s64 timestamp)
 {
-	struct qmc5883_data *data = iio_priv(dev_to_iio_dev(dev));
-	size_t len = 0;
-	int i;
+	s64 delta = iio_get_time_ns(iio_priv_to_dev(data)) - timestamp;
 
-	pr_info("qmc5883_show_samp_freq_avail++\n");
+	atomic64_inc(&data->stats.pushed);
+	qmc5883_stats_hist(data->stats.latency_hist,
+			delta > 0 ? div_u64(delta, NSEC_PER_USEC) : 0);
+}
 
-	for (i = 0; i < data->variant->n_regval_to_samp_freq; i++)
-		len += scnprintf(buf + len, PAGE_SIZE - len,
-			"%d.%d", data->variant->regval_to_samp_freq[i][0],
-			data->variant->regval_to_samp_freq[i][1]);
+/*
+ * Fetch a whole sample in one I2C transfer. The status byte comes with
+ * the data, so DRDY, OVL and DOR are checked without a separate status
+ * read. With @poll set the burst is repeated until DRDY is reported.
+ */
+static int qmc5883_read_burst(struct qmc5883_data *data, u8 *buf, bool poll)
+{
+	int tries = 150;
+	int polls = 0;
+	int ret;
 
-	buf[len - 1] = '\n';
+	while (tries-- > 0) {
+		trace_qmc5883_burst_start(data->dev, QMC5883_DATA_OUT_LSB_REGS,
+					QMC5883_BURST_LEN);
+		ret = regmap_bulk_read(data->regmap, QMC5883_DATA_OUT_LSB_REGS,
+					buf, QMC5883_BURST_LEN);
+		qmc5883_stats_transfer(data, QMC5883_BURST_LEN);
+		trace_qmc5883_burst_end(data->dev, QMC5883_BURST_LEN,
+					ret ? 0 : buf[QMC5883_BURST_STATUS], ret);
+		polls++;
+		if (ret < 0)
+			goto out;
+		if (!poll || (buf[QMC5883_BURST_STATUS] & QMC5883_DATA_READY))
+			goto out;
+		msleep(20);
+	}
 
-	return len;
-}
+	dev_err(data->dev, "data not ready\n");
+	ret = -EIO;
+out:
+	qmc5883_stats_hist(data->stats.polls_hist, polls);
+	trace_qmc5883_poll(data->dev, polls, ret);
 
-static IIO_DEV_ATTR_SAMP_FREQ_AVAIL(qmc5883_show_samp_freq_avail);
+	return ret;
+}
 
-static int qmc5883_set_samp_freq(struct qmc5883_data *data, u8 rate)
+/* v = coef * v with a Q16 row major matrix, no clamping */
+static void qmc5883_matrix_apply(const s32 *coef, s32 *v)
 {
-	int ret;
+	s32 in[3] = { v[0], v[1], v[2] };
+	s64 acc;
+	int i;
 
-	pr_info("qmc5883_set_samp_freq++\n");
+	for (i = 0; i < 3; i++) {
+		acc = (s64)coef[3 * i] * in[0] +
+			(s64)coef[3 * i + 1] * in[1] +
+			(s64)coef[3 * i + 2] * in[2];
+		v[i] = acc >> QMC5883_CALIB_SHIFT;
+	}
+}
 
-	mutex_lock(&data->lock);
-	ret = regmap_update_bits(data->regmap, QMC5883_CONTROL_REG_1,
-				QMC5883_RATE_MASK,
-				rate << QMC5883_RATE_OFFSET);
-	mutex_unlock(&data->lock);
+/* v = calibscale * soft_iron * (v + calibbias) */
+static void qmc5883_calib_apply(const struct qmc5883_calib *calib, s32 *v)
+{
+	int i;
 
-	return ret;
+	for (i = 0; i < 3; i++)
+		v[i] += calib->bias[i];
+
+	qmc5883_matrix_apply(calib->coef, v);
 }
 
 /*
-static int qmc5883_set_oversampling_ratio(struct qmc5883_data *data, u8 ratio)
+ * Most boards mount the chip with its axes along the board's, so the
+ * matrix is a signed permutation. Those are applied with one load and
+ * one multiply per axis, anything else goes through the Q16 product.
+ */
+static void qmc5883_rotation_apply(const struct qmc5883_rotation *rot,
+				s32 *v)
 {
-	int ret;
+	s32 in[3] = { v[0], v[1], v[2] };
 
-	pr_info("qmc5883_set_oversampling_ratio++\n");
+	if (!rot->permute) {
+		qmc5883_matrix_apply(rot->coef, v);
+		return;
+	}
 
-	mutex_lock(&data->lock);
-	ret = regmap_update_bits(data->regmap, QMC5883_CONTROL_REG_1,
-				QMC5883_OVERSAMPLING_MASK,
-				ratio << QMC5883_OVERSAMPLING_OFFSET);
-	mutex_unlock(&data->lock);
+	v[0] = rot->sign[0] * in[rot->src[0]];
+	v[1] = rot->sign[1] * in[rot->src[1]];
+	v[2] = rot->sign[2] * in[rot->src[2]];
+}
 
-	return ret;
+/*
+ * atan2(y, x) as a binary angle in [0, 0x10000). The ratio of the smaller
+ * to the larger component is looked up in qmc5883_atan_tbl[] with linear
+ * interpolation, within 2 units (0.01 degree), and mapped to its octant.
+ */
+static u16 qmc5883_atan2(s32 y, s32 x)
+{
+	u32 ax = abs(x), ay = abs(y);
+	u32 ratio, idx, frac;
+	u32 angle;
+
+	if (!ax && !ay)
+		return 0;
+
+	ratio = div_u64((u64)min(ax, ay) << 16, max(ax, ay));
+	idx = ratio >> 10;
+	frac = ratio & 0x3ff;
+	angle = qmc5883_atan_tbl[idx];
+	if (frac)
+		angle += ((qmc5883_atan_tbl[idx + 1] - angle) * frac) >> 10;
+
+	if (ay > ax)
+		angle = 0x4000 - angle;
+	if (x < 0)
+		angle = 0x8000 - angle;
+	if (y < 0)
+		angle = 0x10000 - angle;
+
+	return angle;
 }
-*/
 
-static int qmc5883_get_samp_freq_index(struct qmc5883_data *data,
-					int val, int val2)
+/* Run the enabled processing stages. Called with data->read_lock held. */
+static void qmc5883_process(struct qmc5883_data *data, s32 *v)
+{
+	if (data->proc_flags & QMC5883_PROC_CALIB)
+		qmc5883_calib_apply(&data->calib, v);
+	if (data->proc_flags & QMC5883_PROC_ROTATE)
+		qmc5883_rotation_apply(&data->rotation, v);
+}
+
+/* Decode the axes of a burst and run the enabled processing stages */
+static void qmc5883_burst_vector(struct qmc5883_data *data, const u8 *buf,
+				s32 *v)
 {
 	int i;
 
-	for (i = 0; i < data->variant->n_regval_to_samp_freq; i++) {
-		pr_info("Amar: get_samp, val = %d, val2=%d\n", val, val2);
-		pr_info("Amar: data->var->regval_freq[i][0] = %d\n", data->variant->regval_to_samp_freq[i][0]);
-		pr_info("Amar: data->var->regval_freq[i][1] = %d\n", data->variant->regval_to_samp_freq[i][1]);
-		if (val == data->variant->regval_to_samp_freq[i][0] &&
-		val2 == data->variant->regval_to_samp_freq[i][1])
-			return i;
-	}
+	for (i = 0; i < 3; i++)
+		v[i] = (s16)get_unaligned_le16(&buf[2 * i]);
 
-	return -EINVAL;
+	qmc5883_process(data, v);
 }
 
-static ssize_t qmc5883_show_oversampling_ratio_avail(struct device *dev,
-				struct device_attribute *attr, char *buf)
+/*
+ * Publish a burst and its processed vector @v as the latest sample.
+ * Only the producer holding data->read_lock gets here, readers pick the
+ * sample up under the seqlock without ever waiting for the bus.
+ */
+static void qmc5883_store_sample(struct qmc5883_data *data, const u8 *buf,
+				const s32 *v)
 {
-	struct qmc5883_data *data = iio_priv(dev_to_iio_dev(dev));
-	size_t len = 0;
+	struct qmc5883_sample *sample = &data->sample;
 	int i;
 
-	pr_info("qmc5883_show_oversampling_ratio_avail++\n");
-	pr_info("qmc5883_show_oversampling_ratio_avail: buf = %p\n", buf);
-	pr_info("qmc5883_show_oversampling_ratio_avail: buf = %d\n",
-			data->variant->n_regval_to_oversampling_ratio);
+	write_seqlock(&data->sample_lock);
+	for (i = 0; i < 3; i++) {
+		sample->axes[i] = (s16)get_unaligned_le16(&buf[2 * i]);
+		sample->vec[i] = v[i];
+	}
+	sample->status = buf[QMC5883_BURST_STATUS];
+	sample->temp = (s16)get_unaligned_le16(&buf[QMC5883_BURST_TEMP]);
+	sample->stamp_ns = ktime_get_ns();
+	sample->seq++;
+	write_sequnlock(&data->sample_lock);
+
+	atomic64_inc(&data->stats.samples);
+	/* DOR: the chip overwrote at least one sample nobody read */
+	if (buf[QMC5883_BURST_STATUS] & QMC5883_DATA_SKIPPED)
+		atomic64_inc(&data->stats.skipped);
+	/* OVL: at least one axis is out of the selected range */
+	if (buf[QMC5883_BURST_STATUS] & QMC5883_OVERFLOW)
+		atomic64_inc(&data->stats.overflow);
+}
 
-	for (i = 0; i < data->variant->n_regval_to_oversampling_ratio; i++) {
-		pr_info("Loading to buf=%d.%d\n", data->variant->regval_to_oversampling_ratio[i][0], data->variant->regval_to_oversampling_ratio[i][1]);
+static void qmc5883_invalidate_sample(struct qmc5883_data *data)
+{
+	write_seqlock(&data->sample_lock);
+	data->sample.stamp_ns = 0;
+	write_sequnlock(&data->sample_lock);
+}
 
-		len += scnprintf(buf + len, PAGE_SIZE - len,
-		"%d.%d ", data->variant->regval_to_oversampling_ratio[i][0],
-		data->variant->regval_to_oversampling_ratio[i][1]);
-	}
+/*
+ * Copy the latest sample and tell whether it may be served. While a
+ * buffer is streaming on the DRDY or timer trigger the trigger handler
+ * keeps it current, so any valid sample is good enough and sysfs readers
+ * stay off the bus. Any other trigger may fire far apart, its samples
+ * age as usual.
+ */
+static bool qmc5883_get_sample(struct qmc5883_data *data,
+			struct qmc5883_sample *sample)
+{
+	u64 max_age = (u64)READ_ONCE(data->sample_max_age_ms) * NSEC_PER_MSEC;
+	unsigned int seq;
 
-	buf[len - 1] = '\n';
+	do {
+		seq = read_seqbegin(&data->sample_lock);
+		*sample = data->sample;
+	} while (read_seqretry(&data->sample_lock, seq));
 
-	pr_info("qmc5883_show_oversampling_ratio_avail: ret len= %ld\n", len);
-	return len;
+	if (!sample->stamp_ns)
+		return false;
+
+	return READ_ONCE(data->own_streams) ||
+		ktime_get_ns() - sample->stamp_ns <= max_age;
 }
 
-static IIO_DEVICE_ATTR(oversampling_ratio_available, S_IRUGO,
-		qmc5883_show_oversampling_ratio_avail, NULL, 0);
+static int qmc5883_read_measurement(struct qmc5883_data *data,
+				struct iio_chan_spec const *chan, int *val)
+{
+	struct qmc5883_sample sample;
+	u8 buf[QMC5883_BURST_LEN];
+	s32 v[3];
+	int ret;
 
-static ssize_t qmc5883_show_scale_avail(struct device *dev,
+	/*
+	 * All three axes and the temperature come from one burst, so
+	 * reading them in a row within the max age window costs a single
+	 * bus transfer and returns a coherent vector.
+	 */
+	if (!qmc5883_get_sample(data, &sample)) {
+		mutex_lock(&data->read_lock);
+		/* Somebody else may have refreshed it while we waited */
+		if (!qmc5883_get_sample(data, &sample)) {
+			ret = qmc5883_set_power_state(data, true);
+			if (!ret) {
+				ret = qmc5883_read_burst(data, buf, true);
+				qmc5883_set_power_state(data, false);
+			}
+			if (ret < 0) {
+				mutex_unlock(&data->read_lock);
+				return ret;
+			}
+			qmc5883_burst_vector(data, buf, v);
+			qmc5883_store_sample(data, buf, v);
+			qmc5883_get_sample(data, &sample);
+		}
+		mutex_unlock(&data->read_lock);
+	}
+	if (chan->type == IIO_TEMP) {
+		*val = sample.temp;
+	} else if (chan->type == IIO_ROT) {
+		/* Only worked out here, the sample carries the vector */
+		*val = qmc5883_atan2(sample.vec[1], sample.vec[0]);
+	} else {
+		*val = sample.axes[chan->scan_index];
+	}
+
+	return IIO_VAL_INT;
+}
+
+static ssize_t qmc5883_show_sample_max_age(struct device *dev,
 				struct device_attribute *attr, char *buf)
 {
 	struct qmc5883_data *data = iio_priv(dev_to_iio_dev(dev));
-	size_t len = 0;
-	int i;
 
-	pr_info("qmc5883_show_scaleavail++\n");
-	pr_info("qmc5883_show_scale_avail: buf = %p\n", buf);
-	pr_info("qmc5883_show_scale_avail: buf = %d\n",
-			data->variant->n_regval_to_full_scale);
+	return sprintf(buf, "%u\n", data->sample_max_age_ms);
+}
 
-	for (i = 0; i < data->variant->n_regval_to_full_scale; i++) {
-		pr_info("Loading to buf=%d\n", data->variant->regval_to_full_scale[i]);
+static ssize_t qmc5883_store_sample_max_age(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t len)
+{
+	struct qmc5883_data *data = iio_priv(dev_to_iio_dev(dev));
+	unsigned int val;
+	int ret;
 
-		len += scnprintf(buf + len, PAGE_SIZE - len,
-		"%d ", data->variant->regval_to_full_scale[i]);
-	}
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
 
-	buf[len - 1] = '\n';
+	WRITE_ONCE(data->sample_max_age_ms, val);
 
-	pr_info("qmc5883_show_scale_avail: ret len= %ld\n", len);
 	return len;
 }
 
-static IIO_DEVICE_ATTR(scale_available, S_IRUGO,
-		qmc5883_show_scale_avail, NULL, 0);
+static IIO_DEVICE_ATTR(sample_max_age_ms, S_IRUGO | S_IWUSR,
+		qmc5883_show_sample_max_age, qmc5883_store_sample_max_age, 0);
 
-static int qmc5883_read_raw(struct iio_dev *indio_dev,
-			struct iio_chan_spec const *chan,
-			int *val, int *val2, long mask)
+static const struct iio_info qmc5883_tap_info;
+
+/* The buffer taps carry a struct qmc5883_tap rather than the device data */
+static struct qmc5883_data *qmc5883_dev_data(struct iio_dev *indio_dev)
 {
-	struct qmc5883_data *data = iio_priv(indio_dev);
-	unsigned int rval;
-	int ret = 0;
+	struct qmc5883_tap *tap;
 
-	pr_info("qmc5883_read_raw++\n");
-	pr_info("qmc5883_read_raw: chan->scan_index = %d\n", chan->scan_index);
-	pr_info("qmc5883_read_raw: chan->address = %ld\n", chan->address);
+	if (indio_dev->info != &qmc5883_tap_info)
+		return iio_priv(indio_dev);
 
-	switch (mask) {
-		case IIO_CHAN_INFO_RAW:
-			pr_info("qmc5883_read_raw: IIO_CHAN_INFO_RAW\n");
-			return qmc5883_read_measurement(data, chan->scan_index, val);
-		case IIO_CHAN_INFO_SCALE:
-			pr_info("qmc5883_read_raw: IIO_CHAN_INFO_SCALE\n");
-			ret = regmap_read(data->regmap, QMC5883_CONTROL_REG_1, &rval);
-			if (ret < 0 || ret > 2)
-				return ret;
-			rval >>= QMC5883_RANGE_GAIN_OFFSET;
-			*val = data->variant->regval_to_full_scale[rval];
-			return IIO_VAL_INT;
-		case IIO_CHAN_INFO_SAMP_FREQ:
-			pr_info("qmc5883_read_raw: IIO_CHAN_INFO_SAMP_FREQ\n");
-			ret = regmap_read(data->regmap, QMC5883_CONTROL_REG_1, &rval);
-			if (ret < 0)
-				return ret;
-			rval >>= QMC5883_RATE_OFFSET;
-			*val = data->variant->regval_to_samp_freq[rval][0];
-			*val2 = data->variant->regval_to_samp_freq[rval][1];
-			return IIO_VAL_INT_PLUS_MICRO;
-		case IIO_CHAN_INFO_OVERSAMPLING_RATIO:
-			pr_info("qmc5883_read_raw: IIO_CHAN_INFO_OVERSAMPLING_RATIO\n");
-			ret = regmap_read(data->regmap, QMC5883_CONTROL_REG_1, &rval);
-			if (ret < 0)
-				return ret;
-			rval >>= QMC5883_OVERSAMPLING_OFFSET;
-			*val = data->variant->regval_to_oversampling_ratio[rval][0];
-			*val2 = data->variant->regval_to_oversampling_ratio[rval][1];
-			return IIO_VAL_INT;
-	}
-	return ret;
+	tap = iio_priv(indio_dev);
+	return tap->data;
 }
 
-static int qmc5883_write_raw(struct iio_dev *indio_dev,
-			struct iio_chan_spec const *chan,
-			int val, int val2, long mask)
+static struct qmc5883_decimator *qmc5883_dev_decim(struct iio_dev *indio_dev)
 {
-	struct qmc5883_data *data = iio_priv(indio_dev);
-	int rate;
-
-	pr_info("qmc5883_write_raw++\n");
-	
-	switch (mask) {
-		case IIO_CHAN_INFO_SAMP_FREQ:
-			rate = qmc5883_get_samp_freq_index(data, val, val2);
-			if (rate < 0) {
-				pr_info("Amar: get_samp rate error\n");
-				return -EINVAL;
-			}
+	struct qmc5883_tap *tap;
 
-			return qmc5883_set_samp_freq(data, rate);
+	if (indio_dev->info != &qmc5883_tap_info)
+		return &qmc5883_dev_data(indio_dev)->decim;
 
-		default:
-			pr_info("Amar: case default, returning -EINVAL\n");
-			return -EINVAL;
-	}
+	tap = iio_priv(indio_dev);
+	return &tap->decim;
 }
 
-static int qmc5883_write_raw_get_fmt(struct iio_dev *indio_dev,
-			struct iio_chan_spec const *chan,
-			long mask)
+static ssize_t qmc5883_show_decimation(struct device *dev,
+				struct device_attribute *attr, char *buf)
 {
-	pr_info("qmc5883_write_raw_get_fmt++\n");
+	struct qmc5883_decimator *decim = qmc5883_dev_decim(dev_to_iio_dev(dev));
 
-	switch(mask) {
-		case IIO_CHAN_INFO_SAMP_FREQ:
-			return IIO_VAL_INT_PLUS_MICRO;
-		case IIO_CHAN_INFO_SCALE:
-			return IIO_VAL_INT;
-		case IIO_CHAN_INFO_OVERSAMPLING_RATIO:
-			return IIO_VAL_INT;
-		default:
-			return -EINVAL;
-	}
+	return sprintf(buf, "%u\n", READ_ONCE(decim->factor));
 }
 
-static irqreturn_t qmc5883_trigger_handler(int irq, void *p)
+static ssize_t qmc5883_store_decimation(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t len)
 {
-	struct iio_poll_func *pf = p;
-	struct iio_dev *indio_dev = pf->indio_dev;
-	struct qmc5883_data *data = iio_priv(indio_dev);
+	struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+	struct qmc5883_data *data = qmc5883_dev_data(indio_dev);
+	struct qmc5883_decimator *decim = qmc5883_dev_decim(indio_dev);
+	unsigned int val;
 	int ret;
 
-	pr_info("qmc5883_trigger_handler++\n");
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+	if (!val || val > QMC5883_DECIMATION_MAX)
+		return -EINVAL;
 
-	mutex_lock(&data->lock);
-	ret = qmc5883_wait_measurement(data);
-	if (ret < 0) {
-		mutex_unlock(&data->lock);
-		goto done;
-	}
+	mutex_lock(&data->read_lock);
+	decim->factor = val;
+	decim->count = 0;
+	mutex_unlock(&data->read_lock);
 
-	ret = regmap_bulk_read(data->regmap, QMC5883_DATA_OUT_LSB_REGS,
-			data->scan.chans, sizeof(data->scan.chans));
+	return len;
+}
 
-	mutex_unlock(&data->lock);
-	if (ret < 0)
-		goto done;
-	
-	iio_push_to_buffers_with_timestamp(indio_dev, &data->scan,
-					iio_get_time_ns(indio_dev));
+static IIO_DEVICE_ATTR(decimation, S_IRUGO | S_IWUSR,
+		qmc5883_show_decimation, qmc5883_store_decimation, 0);
 
-done:
-	iio_trigger_notify_done(indio_dev->trig);
+static const struct iio_mount_matrix *
+qmc5883_get_mount_matrix(const struct iio_dev *indio_dev,
+			const struct iio_chan_spec *chan)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
 
-	return IRQ_HANDLED;
+	return &data->orientation;
 }
 
+/* Fold calibscale into the soft iron matrix, the push path only multiplies */
+static void qmc5883_calib_update(struct qmc5883_calib *calib)
+{
+	s64 micro;
+	int i;
+
+	for (i = 0; i < 9; i++) {
+		micro = div_s64((s64)calib->scale[i / 3] * calib->soft_iron[i],
+				1000000);
+		calib->coef[i] = div_s64(micro * (1 << QMC5883_CALIB_SHIFT),
+					1000000);
+	}
+}
+
+static void qmc5883_calib_init(struct qmc5883_calib *calib)
+{
+	int i;
+
+	memset(calib, 0, sizeof(*calib));
+	for (i = 0; i < 3; i++) {
+		calib->scale[i] = 1000000;
+		calib->soft_iron[4 * i] = 1000000;
+	}
+	qmc5883_calib_update(calib);
+}
+
+static int qmc5883_str_to_micro(const char *str, int *micro)
+{
+	int integer, fract, ret;
+
+	ret = iio_str_to_fixpoint(str, 100000, &integer, &fract);
+	if (ret)
+		return ret;
+	if (abs(integer) >= QMC5883_CALIB_MAX)
+		return -EINVAL;
+
+	/* iio_str_to_fixpoint() only signs the integer part if non-zero */
+	*micro = integer * 1000000 + (integer < 0 ? -fract : fract);
+
+	return 0;
+}
+
+/* Forget the filter history. Called with data->read_lock held. */
+static void qmc5883_filter_reset(struct qmc5883_filter *f)
+{
+	memset(f->sum, 0, sizeof(f->sum));
+	f->pos = 0;
+	f->fill = 0;
+	f->odr = 0;
+}
+
+/*
+ * Derive the coefficients for @odr. A moving average of N taps is 3 dB
+ * down at about 0.443 * odr / N. The IIR uses the first order pole
+ * alpha = w / (odr + w) with w = 2 * pi * cutoff.
+ */
+static void qmc5883_filter_setup(struct qmc5883_filter *f, unsigned int odr)
+{
+	u64 w = div_u64((u64)f->cutoff_uhz * 6283185, 1000000);
+
+	qmc5883_filter_reset(f);
+	f->odr = odr;
+	f->taps = clamp_t(u64, div_u64((u64)odr * 443000 + f->cutoff_uhz / 2,
+				f->cutoff_uhz), 1, QMC5883_FILTER_MAX_TAPS);
+	f->alpha = div64_u64(w << 16, (u64)odr * 1000000 + w);
+}
+
+static void qmc5883_filter_apply(struct qmc5883_filter *f, s32 *v,
+				unsigned int odr)
+{
+	int i;
+
+	if (f->odr != odr)
+		qmc5883_filter_setup(f, odr);
+
+	if (f->type == QMC5883_FILTER_IIR) {
+		for (i = 0; i < 3; i++) {
+			if (f->fill)
+				f->state[i] += ((s64)f->alpha *
+					(((s64)v[i] << 8) - f->state[i])) >> 16;
+			else
+				f->state[i] = (s64)v[i] << 8;
+			v[i] = f->state[i] >> 8;
+		}
+		f->fill = 1;
+		return;
+	}
+
+	for (i = 0; i < 3; i++) {
+		if (f->fill == f->taps)
+			f->sum[i] -= f->hist[f->pos][i];
+		f->hist[f->pos][i] = v[i];
+		f->sum[i] += v[i];
+	}
+	f->pos = (f->pos + 1) % f->taps;
+	if (f->fill < f->taps)
+		f->fill++;
+
+	for (i = 0; i < 3; i++)
+		v[i] = DIV_ROUND_CLOSEST(f->sum[i], (s32)f->fill);
+}
+
+static int qmc5883_rotation_init(struct qmc5883_rotation *rot,
+				const struct iio_mount_matrix *matrix)
+{
+	int i, j, m, nonzero, ret;
+
+	rot->permute = true;
+	for (i = 0; i < 3; i++) {
+		nonzero = 0;
+		for (j = 0; j < 3; j++) {
+			ret = qmc5883_str_to_micro(matrix->rotation[3 * i + j],
+						&m);
+			if (ret)
+				return ret;
+
+			rot->coef[3 * i + j] = div_s64((s64)m *
+						(1 << QMC5883_CALIB_SHIFT),
+						1000000);
+			if (!m)
+				continue;
+			nonzero++;
+			rot->src[i] = j;
+			rot->sign[i] = m < 0 ? -1 : 1;
+			if (abs(m) != 1000000)
+				rot->permute = false;
+		}
+		if (nonzero != 1)
+			rot->permute = false;
+	}
+
+	return 0;
+}
+
+static int qmc5883_micro_to_str(char *buf, size_t len, int micro)
+{
+	return scnprintf(buf, len, "%s%d.%06d", micro < 0 ? "-" : "",
+			abs(micro) / 1000000, abs(micro) % 1000000);
+}
+
+/* Same "a, b, c; d, e, f; g, h, i" layout as mount_matrix */
+static ssize_t qmc5883_read_soft_iron(struct iio_dev *indio_dev,
+				uintptr_t private,
+				struct iio_chan_spec const *chan, char *buf)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+	size_t len = 0;
+	int i;
+
+	mutex_lock(&data->read_lock);
+	for (i = 0; i < 9; i++) {
+		len += qmc5883_micro_to_str(buf + len, PAGE_SIZE - len,
+					data->calib.soft_iron[i]);
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s",
+				i == 8 ? "\n" : i % 3 == 2 ? "; " : ", ");
+	}
+	mutex_unlock(&data->read_lock);
+
+	return len;
+}
+
+static ssize_t qmc5883_write_soft_iron(struct iio_dev *indio_dev,
+				uintptr_t private,
+				struct iio_chan_spec const *chan,
+				const char *buf, size_t len)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+	const char *p = buf;
+	int matrix[9];
+	char tmp[24];
+	size_t n;
+	int i, ret;
+
+	for (i = 0; i < 9; i++) {
+		p = skip_spaces(p);
+		n = strcspn(p, ",;\n");
+		if (!n || n >= sizeof(tmp))
+			return -EINVAL;
+		memcpy(tmp, p, n);
+		tmp[n] = '\0';
+		ret = qmc5883_str_to_micro(strim(tmp), &matrix[i]);
+		if (ret)
+			return ret;
+		p += n;
+		if (i < 8 && *p != ',' && *p != ';')
+			return -EINVAL;
+		if (i < 8)
+			p++;
+	}
+	if (*skip_spaces(p))
+		return -EINVAL;
+
+	mutex_lock(&data->read_lock);
+	memcpy(data->calib.soft_iron, matrix, sizeof(matrix));
+	qmc5883_calib_update(&data->calib);
+	mutex_unlock(&data->read_lock);
+
+	return len;
+}
+
+/* Enable or disable the QMC5883_PROC_* stage given in @private */
+static ssize_t qmc5883_read_proc_flag(struct iio_dev *indio_dev,
+				uintptr_t private,
+				struct iio_chan_spec const *chan, char *buf)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+
+	return sprintf(buf, "%d\n", !!(READ_ONCE(data->proc_flags) & private));
+}
+
+static ssize_t qmc5883_write_proc_flag(struct iio_dev *indio_dev,
+				uintptr_t private,
+				struct iio_chan_spec const *chan,
+				const char *buf, size_t len)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+	bool enable;
+	int ret;
+
+	ret = strtobool(buf, &enable);
+	if (ret)
+		return ret;
+
+	mutex_lock(&data->read_lock);
+	if (enable)
+		data->proc_flags |= private;
+	else
+		data->proc_flags &= ~private;
+	mutex_unlock(&data->read_lock);
+
+	return len;
+}
+
+static const char * const qmc5883_filter_types[] = {
+	[QMC5883_FILTER_MOVING_AVERAGE] = "moving_average",
+	[QMC5883_FILTER_IIR] = "iir",
+};
+
+static int qmc5883_get_filter_type(struct iio_dev *indio_dev,
+				const struct iio_chan_spec *chan)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+
+	return data->filter.type;
+}
+
+static int qmc5883_set_filter_type(struct iio_dev *indio_dev,
+				const struct iio_chan_spec *chan,
+				unsigned int type)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+
+	mutex_lock(&data->read_lock);
+	data->filter.type = type;
+	qmc5883_filter_reset(&data->filter);
+	mutex_unlock(&data->read_lock);
+
+	return 0;
+}
+
+static const struct iio_enum qmc5883_filter_type_enum = {
+	.items = qmc5883_filter_types,
+	.num_items = ARRAY_SIZE(qmc5883_filter_types),
+	.get = qmc5883_get_filter_type,
+	.set = qmc5883_set_filter_type,
+};
+
+static ssize_t qmc5883_read_auto_range(struct iio_dev *indio_dev,
+				uintptr_t private,
+				struct iio_chan_spec const *chan, char *buf)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+
+	return sprintf(buf, "%d\n", READ_ONCE(data->autorange.enabled));
+}
+
+static ssize_t qmc5883_write_auto_range(struct iio_dev *indio_dev,
+				uintptr_t private,
+				struct iio_chan_spec const *chan,
+				const char *buf, size_t len)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+	bool enable;
+	int ret;
+
+	ret = strtobool(buf, &enable);
+	if (ret)
+		return ret;
+
+	mutex_lock(&data->read_lock);
+	data->autorange.enabled = enable;
+	data->autorange.overflows = 0;
+	data->autorange.quiet = 0;
+	mutex_unlock(&data->read_lock);
+
+	return len;
+}
+
+static const struct iio_chan_spec_ext_info qmc5883_ext_info[] = {
+	IIO_MOUNT_MATRIX(IIO_SHARED_BY_DIR, qmc5883_get_mount_matrix),
+	{
+		.name = "soft_iron_matrix",
+		.shared = IIO_SHARED_BY_TYPE,
+		.read = qmc5883_read_soft_iron,
+		.write = qmc5883_write_soft_iron,
+	},
+	{
+		.name = "calibrated",
+		.shared = IIO_SHARED_BY_TYPE,
+		.read = qmc5883_read_proc_flag,
+		.write = qmc5883_write_proc_flag,
+		.private = QMC5883_PROC_CALIB,
+	},
+	{
+		.name = "device_frame",
+		.shared = IIO_SHARED_BY_TYPE,
+		.read = qmc5883_read_proc_flag,
+		.write = qmc5883_write_proc_flag,
+		.private = QMC5883_PROC_ROTATE,
+	},
+	IIO_ENUM("filter_type", IIO_SHARED_BY_TYPE, &qmc5883_filter_type_enum),
+	IIO_ENUM_AVAILABLE("filter_type", &qmc5883_filter_type_enum),
+	{
+		.name = "auto_range",
+		.shared = IIO_SHARED_BY_TYPE,
+		.read = qmc5883_read_auto_range,
+		.write = qmc5883_write_auto_range,
+	},
+	{ }
+};
+
+static ssize_t qmc5883_show_samp_freq_avail(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct qmc5883_data *data = iio_priv(dev_to_iio_dev(dev));
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < data->variant->n_regval_to_samp_freq; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+			"%d.%d", data->variant->regval_to_samp_freq[i][0],
+			data->variant->regval_to_samp_freq[i][1]);
+
+	buf[len - 1] = '\n';
+
+	return len;
+}
+
+static IIO_DEV_ATTR_SAMP_FREQ_AVAIL(qmc5883_show_samp_freq_avail);
+
+static int qmc5883_set_samp_freq(struct qmc5883_data *data, u8 rate)
+{
+	struct qmc5883_config cfg;
+	int ret;
+
+	mutex_lock(&data->lock);
+	cfg = data->config;
+	cfg.odr = rate;
+	ret = qmc5883_apply_config(data, &cfg, false);
+	mutex_unlock(&data->lock);
+	qmc5883_invalidate_sample(data);
+
+	return ret;
+}
+
+static int qmc5883_set_oversampling_ratio(struct qmc5883_data *data, u8 ratio)
+{
+	struct qmc5883_config cfg;
+	int ret;
+
+	mutex_lock(&data->lock);
+	cfg = data->config;
+	cfg.osr = ratio;
+	ret = qmc5883_apply_config(data, &cfg, false);
+	mutex_unlock(&data->lock);
+	qmc5883_invalidate_sample(data);
+
+	return ret;
+}
+
+static int qmc5883_set_range_gain(struct qmc5883_data *data, u8 range)
+{
+	struct qmc5883_config cfg;
+	int ret;
+
+	mutex_lock(&data->lock);
+	cfg = data->config;
+	cfg.range = range;
+	ret = qmc5883_apply_config(data, &cfg, false);
+	mutex_unlock(&data->lock);
+	qmc5883_invalidate_sample(data);
+
+	return ret;
+}
+
+static int qmc5883_get_oversampling_ratio_index(struct qmc5883_data *data,
+						int val)
+{
+	int i;
+
+	for (i = 0; i < data->variant->n_regval_to_oversampling_ratio; i++)
+		if (val == data->variant->regval_to_oversampling_ratio[i][0])
+			return i;
+
+	return -EINVAL;
+}
+
+/* Scale table entry @i in nano gauss per LSB, as written to in_magn_scale */
+static int qmc5883_scale_nano(struct qmc5883_data *data, int i)
+{
+	const int *scale = data->variant->regval_to_scale[i];
+
+	return div_u64(1000000000ULL * scale[0] + scale[1] / 2, scale[1]);
+}
+
+static int qmc5883_get_scale_index(struct qmc5883_data *data,
+				int val, int val2)
+{
+	int i;
+
+	for (i = 0; i < data->variant->n_regval_to_scale; i++)
+		if (!val && val2 == qmc5883_scale_nano(data, i))
+			return i;
+
+	return -EINVAL;
+}
+
+static int qmc5883_get_samp_freq_index(struct qmc5883_data *data,
+					int val, int val2)
+{
+	int i;
+
+	for (i = 0; i < data->variant->n_regval_to_samp_freq; i++) {
+		if (val == data->variant->regval_to_samp_freq[i][0] &&
+		val2 == data->variant->regval_to_samp_freq[i][1])
+			return i;
+	}
+
+	return -EINVAL;
+}
+
+static ssize_t qmc5883_show_oversampling_ratio_avail(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct qmc5883_data *data = iio_priv(dev_to_iio_dev(dev));
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < data->variant->n_regval_to_oversampling_ratio; i++) {
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+		"%d.%d ", data->variant->regval_to_oversampling_ratio[i][0],
+		data->variant->regval_to_oversampling_ratio[i][1]);
+	}
+
+	buf[len - 1] = '\n';
+
+	return len;
+}
+
+static IIO_DEVICE_ATTR(oversampling_ratio_available, S_IRUGO,
+		qmc5883_show_oversampling_ratio_avail, NULL, 0);
+
+static ssize_t qmc5883_show_scale_avail(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct qmc5883_data *data = iio_priv(dev_to_iio_dev(dev));
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < data->variant->n_regval_to_scale; i++) {
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+		"0.%09d ", qmc5883_scale_nano(data, i));
+	}
+
+	buf[len - 1] = '\n';
+
+	return len;
+}
+
+static IIO_DEVICE_ATTR(scale_available, S_IRUGO,
+		qmc5883_show_scale_avail, NULL, 0);
+
+static int qmc5883_read_raw(struct iio_dev *indio_dev,
+			struct iio_chan_spec const *chan,
+			int *val, int *val2, long mask)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+	unsigned int rval;
+	int ret = 0;
+
+	switch (mask) {
+		case IIO_CHAN_INFO_RAW:
+			return qmc5883_read_measurement(data, chan, val);
+		case IIO_CHAN_INFO_OFFSET:
+			*val = QMC5883_TEMP_OFFSET;
+			return IIO_VAL_INT;
+		case IIO_CHAN_INFO_CALIBBIAS:
+			mutex_lock(&data->read_lock);
+			*val = data->calib.bias[chan->scan_index];
+			mutex_unlock(&data->read_lock);
+			return IIO_VAL_INT;
+		case IIO_CHAN_INFO_CALIBSCALE:
+			mutex_lock(&data->read_lock);
+			rval = data->calib.scale[chan->scan_index];
+			mutex_unlock(&data->read_lock);
+			*val = rval / 1000000;
+			*val2 = rval % 1000000;
+			return IIO_VAL_INT_PLUS_MICRO;
+		case IIO_CHAN_INFO_LOW_PASS_FILTER_3DB_FREQUENCY:
+			rval = READ_ONCE(data->filter.cutoff_uhz);
+			*val = rval / 1000000;
+			*val2 = rval % 1000000;
+			return IIO_VAL_INT_PLUS_MICRO;
+		case IIO_CHAN_INFO_SCALE:
+			if (chan->type == IIO_TEMP) {
+				*val = QMC5883_TEMP_SCALE_MILLI;
+				return IIO_VAL_INT;
+			}
+			if (chan->type == IIO_ROT) {
+				*val = 0;
+				*val2 = QMC5883_HEADING_SCALE_NANO;
+				return IIO_VAL_INT_PLUS_NANO;
+			}
+			rval = READ_ONCE(data->config.range);
+			*val = data->variant->regval_to_scale[rval][0];
+			*val2 = data->variant->regval_to_scale[rval][1];
+			return IIO_VAL_FRACTIONAL;
+		case IIO_CHAN_INFO_SAMP_FREQ:
+			rval = READ_ONCE(data->config.odr);
+			*val = data->variant->regval_to_samp_freq[rval][0];
+			*val2 = data->variant->regval_to_samp_freq[rval][1];
+			return IIO_VAL_INT_PLUS_MICRO;
+		case IIO_CHAN_INFO_OVERSAMPLING_RATIO:
+			rval = READ_ONCE(data->config.osr);
+			*val = data->variant->regval_to_oversampling_ratio[rval][0];
+			*val2 = data->variant->regval_to_oversampling_ratio[rval][1];
+			return IIO_VAL_INT;
+	}
+	return ret;
+}
+
+static int qmc5883_write_raw(struct iio_dev *indio_dev,
+			struct iio_chan_spec const *chan,
+			int val, int val2, long mask)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+	int rate;
+
+	/* Temperature and heading attributes are fixed */
+	if (chan->type != IIO_MAGN)
+		return -EINVAL;
+
+	switch (mask) {
+		case IIO_CHAN_INFO_SAMP_FREQ:
+			rate = qmc5883_get_samp_freq_index(data, val, val2);
+			if (rate < 0)
+				return -EINVAL;
+
+			return qmc5883_set_samp_freq(data, rate);
+
+		case IIO_CHAN_INFO_OVERSAMPLING_RATIO:
+			rate = qmc5883_get_oversampling_ratio_index(data, val);
+			if (rate < 0)
+				return -EINVAL;
+
+			return qmc5883_set_oversampling_ratio(data, rate);
+
+		case IIO_CHAN_INFO_SCALE:
+			rate = qmc5883_get_scale_index(data, val, val2);
+			if (rate < 0)
+				return -EINVAL;
+
+			return qmc5883_set_range_gain(data, rate);
+
+		case IIO_CHAN_INFO_CALIBBIAS:
+			if (val < S16_MIN || val > S16_MAX)
+				return -EINVAL;
+
+			mutex_lock(&data->read_lock);
+			data->calib.bias[chan->scan_index] = val;
+			mutex_unlock(&data->read_lock);
+			return 0;
+
+		case IIO_CHAN_INFO_CALIBSCALE:
+			if (val < 0 || val2 < 0 || val >= QMC5883_CALIB_MAX ||
+			    (!val && !val2))
+				return -EINVAL;
+
+			mutex_lock(&data->read_lock);
+			data->calib.scale[chan->scan_index] = val * 1000000 + val2;
+			qmc5883_calib_update(&data->calib);
+			mutex_unlock(&data->read_lock);
+			return 0;
+
+		case IIO_CHAN_INFO_LOW_PASS_FILTER_3DB_FREQUENCY:
+			if (val < 0 || val2 < 0 || val > 1000)
+				return -EINVAL;
+
+			mutex_lock(&data->read_lock);
+			data->filter.cutoff_uhz = val * 1000000 + val2;
+			qmc5883_filter_reset(&data->filter);
+			mutex_unlock(&data->read_lock);
+			return 0;
+
+		default:
+			return -EINVAL;
+	}
+}
+
+static int qmc5883_write_raw_get_fmt(struct iio_dev *indio_dev,
+			struct iio_chan_spec const *chan,
+			long mask)
+{
+	switch(mask) {
+		case IIO_CHAN_INFO_SAMP_FREQ:
+			return IIO_VAL_INT_PLUS_MICRO;
+		case IIO_CHAN_INFO_SCALE:
+			return IIO_VAL_INT_PLUS_NANO;
+		case IIO_CHAN_INFO_OVERSAMPLING_RATIO:
+			return IIO_VAL_INT;
+		case IIO_CHAN_INFO_CALIBBIAS:
+			return IIO_VAL_INT;
+		case IIO_CHAN_INFO_CALIBSCALE:
+			return IIO_VAL_INT_PLUS_MICRO;
+		case IIO_CHAN_INFO_LOW_PASS_FILTER_3DB_FREQUENCY:
+			return IIO_VAL_INT_PLUS_MICRO;
+		default:
+			return -EINVAL;
+	}
+}
+
+/*
+ * The chip has no FIFO, so batch samples in memory and hand them to the
+ * buffer together. Consumers then wake up once per batch rather than once
+ * per sample. Called with data->fifo_lock held.
+ */
+static int qmc5883_fifo_flush(struct iio_dev *indio_dev, unsigned int count)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+	unsigned int i;
+
+	count = min(count, data->fifo_count);
+	if (count)
+		trace_qmc5883_push(data->dev, data->fifo[0].timestamp, count);
+	for (i = 0; i < count; i++) {
+		iio_push_to_buffers_with_timestamp(indio_dev, &data->fifo[i],
+						data->fifo[i].timestamp);
+		qmc5883_stats_push(data, data->fifo[i].timestamp);
+	}
+
+	data->fifo_count -= count;
+	memmove(data->fifo, &data->fifo[count],
+		data->fifo_count * sizeof(data->fifo[0]));
+
+	return count;
+}
+
+static void qmc5883_push_sample(struct iio_dev *indio_dev,
+				struct qmc5883_scan *scan, s64 timestamp)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+
+	mutex_lock(&data->fifo_lock);
+	if (data->fifo_watermark <= 1 && !data->fifo_count) {
+		mutex_unlock(&data->fifo_lock);
+		trace_qmc5883_push(data->dev, timestamp, 1);
+		iio_push_to_buffers_with_timestamp(indio_dev, scan, timestamp);
+		qmc5883_stats_push(data, timestamp);
+		return;
+	}
+
+	data->fifo[data->fifo_count] = *scan;
+	data->fifo[data->fifo_count].timestamp = timestamp;
+	data->fifo_count++;
+
+	if (data->fifo_count >= data->fifo_watermark) {
+		qmc5883_fifo_flush(indio_dev, data->fifo_count);
+		cancel_delayed_work(&data->fifo_work);
+	} else if (data->fifo_count == 1 && data->fifo_timeout_ms) {
+		schedule_delayed_work(&data->fifo_work,
+				msecs_to_jiffies(data->fifo_timeout_ms));
+	}
+	mutex_unlock(&data->fifo_lock);
+}
+
+static void qmc5883_fifo_timeout_work(struct work_struct *work)
+{
+	struct qmc5883_data *data = container_of(to_delayed_work(work),
+						struct qmc5883_data,
+						fifo_work);
+
+	mutex_lock(&data->fifo_lock);
+	qmc5883_fifo_flush(iio_priv_to_dev(data), data->fifo_count);
+	mutex_unlock(&data->fifo_lock);
+}
+
+static int qmc5883_hwfifo_set_watermark(struct iio_dev *indio_dev,
+					unsigned int val)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+
+	mutex_lock(&data->fifo_lock);
+	data->fifo_watermark = clamp_t(unsigned int, val, 1,
+				QMC5883_FIFO_DEPTH);
+	if (data->fifo_count >= data->fifo_watermark)
+		qmc5883_fifo_flush(indio_dev, data->fifo_count);
+	mutex_unlock(&data->fifo_lock);
+
+	return 0;
+}
+
+static int qmc5883_hwfifo_flush_to_buffer(struct iio_dev *indio_dev,
+					unsigned int count)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+	int ret;
+
+	mutex_lock(&data->fifo_lock);
+	ret = qmc5883_fifo_flush(indio_dev, count);
+	mutex_unlock(&data->fifo_lock);
+
+	return ret;
+}
+
+static const int qmc5883_axis_mod[] = { IIO_MOD_X, IIO_MOD_Y, IIO_MOD_Z };
+
+/*
+ * Report @slot when its condition starts to hold. Conditions that keep
+ * holding on the following samples stay quiet until they clear again.
+ */
+static void qmc5883_event_test(struct qmc5883_data *data, int slot,
+			bool hit, u64 code, s64 timestamp)
+{
+	struct qmc5883_events *ev = &data->events;
+
+	if (!test_bit(slot, &ev->enabled))
+		return;
+
+	if (hit && !test_bit(slot, &ev->active))
+		iio_push_event(iio_priv_to_dev(data), code, timestamp);
+
+	if (hit)
+		__set_bit(slot, &ev->active);
+	else
+		__clear_bit(slot, &ev->active);
+}
+
+/*
+ * Evaluate the enabled events on the vector about to be buffered. The
+ * magnitude event compares against the magnitude at its last report,
+ * so it fires again each time the field moves by the threshold.
+ * Called with data->read_lock held.
+ */
+static void qmc5883_check_events(struct qmc5883_data *data, const s32 *v,
+				u8 status, s64 timestamp)
+{
+	struct qmc5883_events *ev = &data->events;
+	unsigned int odr = qmc5883_odr_hz(data);
+	u32 mag;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		qmc5883_event_test(data, QMC5883_EV_RISING(i),
+			v[i] > ev->value[QMC5883_EV_RISING(i)],
+			IIO_MOD_EVENT_CODE(IIO_MAGN, 0, qmc5883_axis_mod[i],
+					IIO_EV_TYPE_THRESH,
+					IIO_EV_DIR_RISING),
+			timestamp);
+		qmc5883_event_test(data, QMC5883_EV_FALLING(i),
+			v[i] < ev->value[QMC5883_EV_FALLING(i)],
+			IIO_MOD_EVENT_CODE(IIO_MAGN, 0, qmc5883_axis_mod[i],
+					IIO_EV_TYPE_THRESH,
+					IIO_EV_DIR_FALLING),
+			timestamp);
+		qmc5883_event_test(data, QMC5883_EV_ROC(i),
+			ev->primed && (s64)abs(v[i] - ev->prev[i]) * odr >
+				ev->value[QMC5883_EV_ROC(i)],
+			IIO_MOD_EVENT_CODE(IIO_MAGN, 0, qmc5883_axis_mod[i],
+					IIO_EV_TYPE_ROC, IIO_EV_DIR_EITHER),
+			timestamp);
+	}
+
+	/* Components are within s16, the sum of squares fits 32 bits */
+	mag = int_sqrt((u32)(v[0] * v[0]) + (u32)(v[1] * v[1]) +
+			(u32)(v[2] * v[2]));
+	if (!ev->primed)
+		ev->mag_ref = mag;
+	if (test_bit(QMC5883_EV_MAG, &ev->enabled) &&
+	    abs((s32)(mag - ev->mag_ref)) > ev->value[QMC5883_EV_MAG]) {
+		iio_push_event(iio_priv_to_dev(data),
+			IIO_MOD_EVENT_CODE(IIO_MAGN, 0,
+					IIO_MOD_ROOT_SUM_SQUARED_X_Y_Z,
+					IIO_EV_TYPE_MAG_ADAPTIVE,
+					IIO_EV_DIR_EITHER),
+			timestamp);
+		ev->mag_ref = mag;
+	}
+
+	qmc5883_event_test(data, QMC5883_EV_OVERFLOW,
+		status & QMC5883_OVERFLOW,
+		IIO_MOD_EVENT_CODE(IIO_MAGN, 0,
+				IIO_MOD_ROOT_SUM_SQUARED_X_Y_Z,
+				IIO_EV_TYPE_MAG, IIO_EV_DIR_RISING),
+		timestamp);
+
+	memcpy(ev->prev, v, sizeof(ev->prev));
+	ev->primed = true;
+}
+
+/*
+ * Decide whether the sample in @buf calls for another full scale range.
+ * Returns the range to switch to, or -1 to stay. Called with
+ * data->read_lock held.
+ */
+static int qmc5883_autorange_check(struct qmc5883_data *data, const u8 *buf)
+{
+	struct qmc5883_autorange *ar = &data->autorange;
+	bool ovl = buf[QMC5883_BURST_STATUS] & QMC5883_OVERFLOW;
+	unsigned int range;
+	int i;
+
+	if (!ar->enabled || ar->settle)
+		return -1;
+
+	range = READ_ONCE(data->config.range);
+
+	if (range == QMC5883_RANGE_2G) {
+		ar->overflows = ovl ? ar->overflows + 1 : 0;
+		if (ar->overflows >= QMC5883_AUTORANGE_OVL_SAMPLES)
+			return QMC5883_RANGE_8G;
+		return -1;
+	}
+
+	for (i = 0; i < 3; i++)
+		if (abs((s16)get_unaligned_le16(&buf[2 * i])) >=
+		    QMC5883_AUTORANGE_LOW_LSB)
+			ovl = true;
+	ar->quiet = ovl ? 0 : ar->quiet + 1;
+	if (ar->quiet >= QMC5883_AUTORANGE_LOW_SAMPLES)
+		return QMC5883_RANGE_2G;
+
+	return -1;
+}
+
+/*
+ * Change range on behalf of auto-ranging. Buffered samples carry no
+ * scale, so the switch is reported as an event on the magnitude channel
+ * (rising for 8G, falling for 2G) and every sample pushed with a later
+ * timestamp uses the new scale. The first sample after the switch may
+ * still be converted in the old range and is dropped.
+ */
+static void qmc5883_autorange_switch(struct qmc5883_data *data,
+				unsigned int range, s64 timestamp)
+{
+	struct iio_dev *indio_dev = iio_priv_to_dev(data);
+
+	if (qmc5883_set_range_gain(data, range) < 0)
+		return;
+
+	mutex_lock(&data->read_lock);
+	data->autorange.overflows = 0;
+	data->autorange.quiet = 0;
+	data->autorange.settle = true;
+	qmc5883_filter_reset(&data->filter);
+	data->events.primed = false;
+	mutex_unlock(&data->read_lock);
+
+	atomic64_inc(&data->stats.range_switches);
+	if (test_bit(QMC5883_EV_RANGE, &data->events.enabled))
+		iio_push_event(indio_dev,
+			IIO_MOD_EVENT_CODE(IIO_MAGN, 0,
+					IIO_MOD_ROOT_SUM_SQUARED_X_Y_Z,
+					IIO_EV_TYPE_THRESH,
+					range == QMC5883_RANGE_8G ?
+					IIO_EV_DIR_RISING :
+					IIO_EV_DIR_FALLING),
+			timestamp);
+}
+
+/*
+ * Pack a burst and its processed vector @v into the scan. Raw samples
+ * are copied as they are, processed ones are run through the low-pass
+ * filter and clamped back into the s16 channels. @v is left filtered
+ * and clamped. Events are checked on every sample, before any buffer
+ * decimates it. The heading is only computed when a buffer asked for
+ * it. Returns whether the sample is valid, i.e. not dropped after a
+ * range switch. Called with data->read_lock held.
+ */
+static bool qmc5883_fill_scan(struct qmc5883_data *data, const u8 *buf,
+			s32 *v, s64 timestamp)
+{
+	struct qmc5883_filter *filter = &data->filter;
+	bool heading = data->heading_streams;
+	bool processed = data->proc_flags || filter->cutoff_uhz;
+	int i;
+
+	if (data->autorange.settle) {
+		data->autorange.settle = false;
+		return false;
+	}
+
+	/* Same byte order on the wire and in the scan, no conversion */
+	memcpy(data->scan.chans, buf, sizeof(data->scan.chans));
+	memcpy(&data->scan.temp, &buf[QMC5883_BURST_TEMP],
+		sizeof(data->scan.temp));
+
+	if (filter->cutoff_uhz)
+		qmc5883_filter_apply(filter, v, qmc5883_odr_hz(data));
+	for (i = 0; i < 3; i++)
+		v[i] = clamp_t(s32, v[i], S16_MIN, S16_MAX);
+
+	if (data->events.enabled)
+		qmc5883_check_events(data, v, buf[QMC5883_BURST_STATUS],
+				timestamp);
+
+	if (processed)
+		for (i = 0; i < 3; i++)
+			data->scan.chans[i] = cpu_to_le16(v[i]);
+	if (heading)
+		data->scan.heading = cpu_to_le16(qmc5883_atan2(v[1], v[0]));
+
+	return true;
+}
+
+/*
+ * Get the sample of a trigger fire for one buffer. Every buffer on our
+ * own triggers is polled with the same timestamp for a conversion, so
+ * the first one to get here reads the chip and the others reuse its
+ * scan: the bus cost stays one burst per conversion whatever the number
+ * of buffers. Returns 1 with the sample copied to @scan when @decim lets
+ * it through, 0 when there is nothing to push, or a negative error.
+ */
+static int qmc5883_produce(struct qmc5883_data *data,
+			struct iio_trigger *trig, s64 timestamp,
+			struct qmc5883_decimator *decim,
+			struct qmc5883_scan *scan)
+{
+	bool own_trig = trig == data->drdy_trig || trig == data->timer_trig;
+	u8 buf[QMC5883_BURST_LEN];
+	s32 v[3];
+	int range = -1;
+	int ret = 0;
+
+	mutex_lock(&data->read_lock);
+	if (!own_trig || timestamp != data->scan_ts) {
+		data->scan_ts = own_trig ? timestamp : 0;
+		data->scan_valid = false;
+
+		/*
+		 * When fired by one of our own triggers the data registers
+		 * are expected to hold a fresh sample, so a single burst is
+		 * enough.
+		 */
+		ret = qmc5883_read_burst(data, buf, !own_trig);
+		if (!ret && (buf[QMC5883_BURST_STATUS] & QMC5883_DATA_READY)) {
+			qmc5883_burst_vector(data, buf, v);
+			range = qmc5883_autorange_check(data, buf);
+			data->scan_valid = qmc5883_fill_scan(data, buf, v,
+							timestamp);
+			qmc5883_store_sample(data, buf, v);
+		} else if (!ret && trig == data->timer_trig) {
+			/* The timer ran ahead of the conversion, let it slip */
+			atomic64_add(data->timer_period_ns /
+				QMC5883_HRTIMER_SKEW_DIV,
+				&data->timer_skew_ns);
+		}
+	}
+
+	if (!ret && data->scan_valid && ++decim->count >= decim->factor) {
+		decim->count = 0;
+		*scan = data->scan;
+		ret = 1;
+	}
+	mutex_unlock(&data->read_lock);
+
+	if (range >= 0)
+		qmc5883_autorange_switch(data, range, timestamp);
+
+	return ret;
+}
+
+/*
+ * Consumers of our own triggers share the time of the fire, which is also
+ * what qmc5883_produce() tells conversions apart by.
+ */
+static irqreturn_t qmc5883_pollfunc_store_time(int irq, void *p)
+{
+	struct iio_poll_func *pf = p;
+	struct iio_dev *indio_dev = pf->indio_dev;
+	struct qmc5883_data *data = qmc5883_dev_data(indio_dev);
+
+	if (indio_dev->trig == data->drdy_trig ||
+	    indio_dev->trig == data->timer_trig)
+		pf->timestamp = data->trig_ts;
+	else
+		pf->timestamp = iio_get_time_ns(indio_dev);
+
+	return IRQ_WAKE_THREAD;
+}
+
+static irqreturn_t qmc5883_trigger_handler(int irq, void *p)
+{
+	struct iio_poll_func *pf = p;
+	struct iio_dev *indio_dev = pf->indio_dev;
+	struct qmc5883_data *data = iio_priv(indio_dev);
+	struct qmc5883_scan scan;
+
+	trace_qmc5883_trigger(data->dev, pf->timestamp);
+
+	if (qmc5883_produce(data, indio_dev->trig, pf->timestamp,
+			&data->decim, &scan) > 0)
+		qmc5883_push_sample(indio_dev, &scan, pf->timestamp);
+
+	iio_trigger_notify_done(indio_dev->trig);
+
+	return IRQ_HANDLED;
+}
+
+static irqreturn_t qmc5883_tap_trigger_handler(int irq, void *p)
+{
+	struct iio_poll_func *pf = p;
+	struct iio_dev *indio_dev = pf->indio_dev;
+	struct qmc5883_tap *tap = iio_priv(indio_dev);
+	struct qmc5883_data *data = tap->data;
+	struct qmc5883_scan scan;
+
+	if (qmc5883_produce(data, indio_dev->trig, pf->timestamp,
+			&tap->decim, &scan) > 0) {
+		trace_qmc5883_push(data->dev, pf->timestamp, 1);
+		iio_push_to_buffers_with_timestamp(indio_dev, &scan,
+						pf->timestamp);
+		qmc5883_stats_push(data, pf->timestamp);
+	}
+
+	iio_trigger_notify_done(indio_dev->trig);
+
+	return IRQ_HANDLED;
+}
+
+static int qmc5883_drdy_trigger_set_state(struct iio_trigger *trig,
+					bool state)
+{
+	struct iio_dev *indio_dev = iio_trigger_get_drvdata(trig);
+	struct qmc5883_data *data = iio_priv(indio_dev);
+	struct qmc5883_config cfg;
+	u8 buf[QMC5883_BURST_LEN];
+	int ret;
+
+	mutex_lock(&data->lock);
+	cfg = data->config;
+	cfg.int_enabled = state;
+	ret = qmc5883_apply_config(data, &cfg, false);
+	mutex_unlock(&data->lock);
+
+	/*
+	 * DRDY is edge triggered and only drops once the data registers
+	 * are read, so drain any sample left over from before the trigger
+	 * was enabled or the pin would never see another rising edge.
+	 */
+	if (!ret && state) {
+		mutex_lock(&data->read_lock);
+		ret = qmc5883_read_burst(data, buf, false);
+		mutex_unlock(&data->read_lock);
+	}
+
+	return ret;
+}
+
+static const struct iio_trigger_ops qmc5883_drdy_trigger_ops = {
+	.set_trigger_state = qmc5883_drdy_trigger_set_state,
+};
+
+static irqreturn_t qmc5883_drdy_irq_handler(int irq, void *private)
+{
+	struct iio_trigger *trig = private;
+	struct qmc5883_data *data = iio_priv(iio_trigger_get_drvdata(trig));
+
+	data->trig_ts = iio_get_time_ns(iio_priv_to_dev(data));
+	iio_trigger_poll(trig);
+
+	return IRQ_HANDLED;
+}
+
+static int qmc5883_setup_drdy_trigger(struct iio_dev *indio_dev,
+				const char *name)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+	struct iio_trigger *trig;
+	int ret;
+
+	trig = devm_iio_trigger_alloc(data->dev, "%s-dev%d",
+				name, indio_dev->id);
+	if (!trig)
+		return -ENOMEM;
+
+	trig->dev.parent = data->dev;
+	trig->ops = &qmc5883_drdy_trigger_ops;
+	iio_trigger_set_drvdata(trig, indio_dev);
+
+	ret = devm_request_irq(data->dev, data->irq,
+			qmc5883_drdy_irq_handler,
+			IRQF_TRIGGER_RISING, name, trig);
+	if (ret < 0) {
+		dev_err(data->dev, "unable to request DRDY irq %d\n",
+			data->irq);
+		return ret;
+	}
+
+	ret = iio_trigger_register(trig);
+	if (ret < 0)
+		return ret;
+
+	data->drdy_trig = trig;
+	/* DRDY is the natural pace for the triggered buffer */
+	indio_dev->trig = iio_trigger_get(trig);
+
+	return 0;
+}
+
+static enum hrtimer_restart qmc5883_hrtimer_handler(struct hrtimer *timer)
+{
+	struct qmc5883_data *data = container_of(timer, struct qmc5883_data,
+						timer);
+
+	data->trig_ts = iio_get_time_ns(iio_priv_to_dev(data));
+	iio_trigger_poll(data->timer_trig);
+
+	hrtimer_forward_now(timer, ns_to_ktime(data->timer_period_ns));
+	hrtimer_add_expires_ns(timer,
+			atomic64_xchg(&data->timer_skew_ns, 0));
+
+	return HRTIMER_RESTART;
+}
+
+static int qmc5883_timer_trigger_set_state(struct iio_trigger *trig,
+					bool state)
+{
+	struct iio_dev *indio_dev = iio_trigger_get_drvdata(trig);
+	struct qmc5883_data *data = iio_priv(indio_dev);
+
+	mutex_lock(&data->lock);
+	data->timer_enabled = state;
+	if (state)
+		qmc5883_hrtimer_arm(data);
+	else
+		hrtimer_cancel(&data->timer);
+	mutex_unlock(&data->lock);
+
+	return 0;
+}
+
+static const struct iio_trigger_ops qmc5883_timer_trigger_ops = {
+	.set_trigger_state = qmc5883_timer_trigger_set_state,
+};
+
+/*
+ * Without a DRDY line, pace the buffer with a timer locked to the ODR
+ * instead of leaving it to an external trigger of unrelated period.
+ */
+static int qmc5883_setup_timer_trigger(struct iio_dev *indio_dev,
+				const char *name)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+	struct iio_trigger *trig;
+	int ret;
+
+	trig = devm_iio_trigger_alloc(data->dev, "%s-timer-dev%d",
+				name, indio_dev->id);
+	if (!trig)
+		return -ENOMEM;
+
+	trig->dev.parent = data->dev;
+	trig->ops = &qmc5883_timer_trigger_ops;
+	iio_trigger_set_drvdata(trig, indio_dev);
+
+	hrtimer_init(&data->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	data->timer.function = qmc5883_hrtimer_handler;
+
+	ret = iio_trigger_register(trig);
+	if (ret < 0)
+		return ret;
+
+	data->timer_trig = trig;
+	indio_dev->trig = iio_trigger_get(trig);
+
+	return 0;
+}
+
+static const struct iio_event_spec qmc5883_axis_events[] = {
+	{
+		.type = IIO_EV_TYPE_THRESH,
+		.dir = IIO_EV_DIR_RISING,
+		.mask_separate = BIT(IIO_EV_INFO_VALUE) |
+			BIT(IIO_EV_INFO_ENABLE),
+	}, {
+		.type = IIO_EV_TYPE_THRESH,
+		.dir = IIO_EV_DIR_FALLING,
+		.mask_separate = BIT(IIO_EV_INFO_VALUE) |
+			BIT(IIO_EV_INFO_ENABLE),
+	}, {
+		.type = IIO_EV_TYPE_ROC,
+		.dir = IIO_EV_DIR_EITHER,
+		.mask_separate = BIT(IIO_EV_INFO_VALUE) |
+			BIT(IIO_EV_INFO_ENABLE),
+	},
+};
+
+static const struct iio_event_spec qmc5883_magnitude_events[] = {
+	{
+		.type = IIO_EV_TYPE_MAG_ADAPTIVE,
+		.dir = IIO_EV_DIR_EITHER,
+		.mask_separate = BIT(IIO_EV_INFO_VALUE) |
+			BIT(IIO_EV_INFO_ENABLE),
+	}, {
+		/* OVL reported by the chip */
+		.type = IIO_EV_TYPE_MAG,
+		.dir = IIO_EV_DIR_RISING,
+		.mask_separate = BIT(IIO_EV_INFO_ENABLE),
+	}, {
+		/* Auto-ranging switched to 8G (rising) or 2G (falling) */
+		.type = IIO_EV_TYPE_THRESH,
+		.dir = IIO_EV_DIR_EITHER,
+		.mask_separate = BIT(IIO_EV_INFO_ENABLE),
+	},
+};
+
 #define QMC5883_CHANNEL(axis, idx)					\
 	{								\
 		.type = IIO_MAGN,					\
 		.modified = 1,						\
 		.channel2 = IIO_MOD_##axis,				\
-		.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),		\
+		.info_mask_separate = BIT(IIO_CHAN_INFO_RAW) |		\
+			BIT(IIO_CHAN_INFO_CALIBBIAS) |			\
+			BIT(IIO_CHAN_INFO_CALIBSCALE),			\
 		.info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE) |	\
 			BIT(IIO_CHAN_INFO_SAMP_FREQ) |			\
-	       		BIT(IIO_CHAN_INFO_OVERSAMPLING_RATIO),		\
+	       		BIT(IIO_CHAN_INFO_OVERSAMPLING_RATIO) |		\
+			BIT(IIO_CHAN_INFO_LOW_PASS_FILTER_3DB_FREQUENCY), \
 		.scan_index = idx,					\
 		.scan_type = {						\
 			.sign = 's',					\
 			.realbits = 16,					\
 			.storagebits = 16,				\
-			.endianness = IIO_BE				\
+			.endianness = IIO_LE				\
 		},							\
-		.ext_info = qmc5883_ext_info,	\
+		.ext_info = qmc5883_ext_info,				\
+		.event_spec = qmc5883_axis_events,			\
+		.num_event_specs = ARRAY_SIZE(qmc5883_axis_events),	\
 	}
 
 static const struct iio_chan_spec qmc5883_channels[] = {
 	QMC5883_CHANNEL(X, 0),
 	QMC5883_CHANNEL(Y, 1),
 	QMC5883_CHANNEL(Z, 2),
-	IIO_CHAN_SOFT_TIMESTAMP(3),
+	{
+		.type = IIO_TEMP,
+		.info_mask_separate = BIT(IIO_CHAN_INFO_RAW) |
+			BIT(IIO_CHAN_INFO_OFFSET) |
+			BIT(IIO_CHAN_INFO_SCALE),
+		.scan_index = 3,
+		.scan_type = {
+			.sign = 's',
+			.realbits = 16,
+			.storagebits = 16,
+			.endianness = IIO_LE
+		},
+	},
+	{
+		.type = IIO_ROT,
+		.modified = 1,
+		.channel2 = IIO_MOD_NORTH_MAGN,
+		.info_mask_separate = BIT(IIO_CHAN_INFO_RAW) |
+			BIT(IIO_CHAN_INFO_SCALE),
+		.scan_index = QMC5883_SCAN_HEADING,
+		.scan_type = {
+			.sign = 'u',
+			.realbits = 16,
+			.storagebits = 16,
+			.endianness = IIO_LE
+		},
+	},
+	{
+		/* Only carries the magnitude, overflow and range events */
+		.type = IIO_MAGN,
+		.modified = 1,
+		.channel2 = IIO_MOD_ROOT_SUM_SQUARED_X_Y_Z,
+		.scan_index = -1,
+		.event_spec = qmc5883_magnitude_events,
+		.num_event_specs = ARRAY_SIZE(qmc5883_magnitude_events),
+	},
+	IIO_CHAN_SOFT_TIMESTAMP(5),
+};
+
+#define QMC5883_TAP_CHANNEL(_type, _mod, idx, _sign)			\
+	{								\
+		.type = _type,						\
+		.modified = (_mod) != IIO_NO_MOD,			\
+		.channel2 = _mod,					\
+		.scan_index = idx,					\
+		.scan_type = {						\
+			.sign = _sign,					\
+			.realbits = 16,					\
+			.storagebits = 16,				\
+			.endianness = IIO_LE				\
+		},							\
+	}
+
+/*
+ * Same scan layout as qmc5883_channels. Everything else is configured on
+ * the main device, which the samples come from.
+ */
+static const struct iio_chan_spec qmc5883_tap_channels[] = {
+	QMC5883_TAP_CHANNEL(IIO_MAGN, IIO_MOD_X, 0, 's'),
+	QMC5883_TAP_CHANNEL(IIO_MAGN, IIO_MOD_Y, 1, 's'),
+	QMC5883_TAP_CHANNEL(IIO_MAGN, IIO_MOD_Z, 2, 's'),
+	QMC5883_TAP_CHANNEL(IIO_TEMP, IIO_NO_MOD, 3, 's'),
+	QMC5883_TAP_CHANNEL(IIO_ROT, IIO_MOD_NORTH_MAGN,
+			QMC5883_SCAN_HEADING, 'u'),
+	IIO_CHAN_SOFT_TIMESTAMP(5),
 };
 
 static struct attribute *qmc5883_attributes[] = {
 	&iio_dev_attr_scale_available.dev_attr.attr,
 	&iio_dev_attr_oversampling_ratio_available.dev_attr.attr,
 	&iio_dev_attr_sampling_frequency_available.dev_attr.attr,
+	&iio_dev_attr_sample_max_age_ms.dev_attr.attr,
+	&iio_dev_attr_decimation.dev_attr.attr,
 	NULL
 };
 
@@ -482,30 +1994,482 @@ static const struct attribute_group qmc5883_group = {
 	.attrs = qmc5883_attributes,
 };
 
+static struct attribute *qmc5883_tap_attributes[] = {
+	&iio_dev_attr_decimation.dev_attr.attr,
+	NULL
+};
+
+static const struct attribute_group qmc5883_tap_group = {
+	.attrs = qmc5883_tap_attributes,
+};
+
 
 static const struct qmc5883_chip_info qmc5883_chip_info_tbl[] = {
 	[QMC5883_ID] = {
 		.channels = qmc5883_channels,
+		.n_channels = ARRAY_SIZE(qmc5883_channels),
 		.regval_to_samp_freq = qmc5883_regval_to_samp_freq,
 		.n_regval_to_samp_freq = ARRAY_SIZE(qmc5883_regval_to_samp_freq),
 		.regval_to_oversampling_ratio = qmc5883_regval_to_oversampling_ratio,
 		.n_regval_to_oversampling_ratio = ARRAY_SIZE(qmc5883_regval_to_oversampling_ratio),
-		.regval_to_full_scale = qmc5883_regval_to_full_scale,
-		.n_regval_to_full_scale = ARRAY_SIZE(qmc5883_regval_to_full_scale),
+		.regval_to_scale = qmc5883_regval_to_scale,
+		.n_regval_to_scale = ARRAY_SIZE(qmc5883_regval_to_scale),
 	}
 };
 
+/*
+ * Keep the DRDY pin quiet until the trigger is enabled and leave ROL_PNT
+ * clear so the address pointer runs linearly and one burst covers 0x00 -
+ * 0x08. Writing every register also fills the cache for the runtime
+ * resume sync.
+ */
 static int qmc5883_init(struct qmc5883_data *data)
 {
+	struct qmc5883_config cfg = {
+		.mode = QMC5883_MODE_CONTINUOUS,
+		.odr = QMC5883_RATE_DEFAULT,
+		.range = QMC5883_RANGE_GAIN_DEFAULT,
+		.osr = QMC5883_OVERSAMPLING_DEFAULT,
+		.int_enabled = false,
+		.rollover = false,
+		.set_reset_period = QMC5883_SET_RESET_PERIOD_DEFAULT,
+	};
+	int ret;
+
+	mutex_lock(&data->lock);
+	ret = qmc5883_apply_config(data, &cfg, true);
+	mutex_unlock(&data->lock);
+
+	return ret;
+}
+
+static ssize_t qmc5883_get_fifo_state(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct qmc5883_data *data = iio_priv(dev_to_iio_dev(dev));
+
+	return sprintf(buf, "%d\n", data->fifo_watermark > 1);
+}
+
+static ssize_t qmc5883_get_fifo_watermark(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct qmc5883_data *data = iio_priv(dev_to_iio_dev(dev));
+
+	return sprintf(buf, "%u\n", data->fifo_watermark);
+}
+
+static ssize_t qmc5883_get_fifo_timeout(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct qmc5883_data *data = iio_priv(dev_to_iio_dev(dev));
+	unsigned int ms = READ_ONCE(data->fifo_timeout_ms);
+
+	return sprintf(buf, "%u.%03u\n", ms / MSEC_PER_SEC,
+		ms % MSEC_PER_SEC);
+}
+
+static ssize_t qmc5883_set_fifo_timeout(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t len)
+{
+	struct qmc5883_data *data = iio_priv(dev_to_iio_dev(dev));
+	int integer, fract;
+	int ret;
+
+	/* seconds, down to the millisecond */
+	ret = iio_str_to_fixpoint(buf, 100, &integer, &fract);
+	if (ret)
+		return ret;
+	if (integer < 0 || fract < 0)
+		return -EINVAL;
+
+	WRITE_ONCE(data->fifo_timeout_ms, integer * MSEC_PER_SEC + fract);
+
+	return len;
+}
+
+static IIO_CONST_ATTR(hwfifo_watermark_min, "1");
+static IIO_CONST_ATTR(hwfifo_watermark_max,
+		      __stringify(QMC5883_FIFO_DEPTH));
+static IIO_DEVICE_ATTR(hwfifo_enabled, S_IRUGO,
+		       qmc5883_get_fifo_state, NULL, 0);
+static IIO_DEVICE_ATTR(hwfifo_watermark, S_IRUGO,
+		       qmc5883_get_fifo_watermark, NULL, 0);
+static IIO_DEVICE_ATTR(hwfifo_timeout, S_IRUGO | S_IWUSR,
+		       qmc5883_get_fifo_timeout, qmc5883_set_fifo_timeout, 0);
+
+static const struct attribute *qmc5883_fifo_attributes[] = {
+	&iio_const_attr_hwfifo_watermark_min.dev_attr.attr,
+	&iio_const_attr_hwfifo_watermark_max.dev_attr.attr,
+	&iio_dev_attr_hwfifo_watermark.dev_attr.attr,
+	&iio_dev_attr_hwfifo_enabled.dev_attr.attr,
+	&iio_dev_attr_hwfifo_timeout.dev_attr.attr,
+	NULL,
+};
+
+/*
+ * Account a buffer, main or tap, that starts streaming. The first one
+ * wakes the chip and drops whatever was converted before the enable, so
+ * the first pushed sample is the next conversion, at most one ODR period
+ * away. Later ones join the running stream without a bus transfer.
+ *
+ * The register cache always holds the running configuration with the
+ * chip in continuous mode, only runtime suspend puts the chip in standby
+ * behind its back. Waking it therefore moves the chip to continuous mode
+ * and applies any ODR/OSR/range written while idle in one pass.
+ */
+static int qmc5883_stream_start(struct qmc5883_data *data,
+				struct iio_dev *indio_dev,
+				struct qmc5883_decimator *decim)
+{
+	u8 buf[QMC5883_BURST_LEN];
+	bool first;
 	int ret;
 
-	pr_info("qmc5883_init++\n");
+	ret = qmc5883_set_power_state(data, true);
+	if (ret < 0)
+		return ret;
+
+	mutex_lock(&data->read_lock);
+	first = !data->streams;
+	if (first) {
+		ret = qmc5883_read_burst(data, buf, false);
+		qmc5883_filter_reset(&data->filter);
+		data->events.primed = false;
+		data->events.active = 0;
+		data->scan_ts = 0;
+		data->scan_valid = false;
+	}
+	if (ret >= 0) {
+		data->streams++;
+		if (indio_dev->trig == data->drdy_trig ||
+		    indio_dev->trig == data->timer_trig)
+			data->own_streams++;
+		if (test_bit(QMC5883_SCAN_HEADING, indio_dev->active_scan_mask))
+			data->heading_streams++;
+		decim->count = 0;
+	}
+	mutex_unlock(&data->read_lock);
+	if (ret < 0) {
+		qmc5883_set_power_state(data, false);
+		return ret;
+	}
+
+	if (first)
+		qmc5883_invalidate_sample(data);
+
+	return 0;
+}
+
+static void qmc5883_stream_stop(struct qmc5883_data *data,
+				struct iio_dev *indio_dev)
+{
+	mutex_lock(&data->read_lock);
+	data->streams--;
+	if (indio_dev->trig == data->drdy_trig ||
+	    indio_dev->trig == data->timer_trig)
+		data->own_streams--;
+	if (test_bit(QMC5883_SCAN_HEADING, indio_dev->active_scan_mask))
+		data->heading_streams--;
+	mutex_unlock(&data->read_lock);
+
+	/* Back to standby right away unless a sysfs reader holds the chip */
+	pm_runtime_put_sync_suspend(data->dev);
+}
+
+static int qmc5883_buffer_preenable(struct iio_dev *indio_dev)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+	int ret;
 
-	ret = qmc5883_set_samp_freq(data, QMC5883_RATE_DEFAULT);
+	ret = qmc5883_stream_start(data, indio_dev, &data->decim);
 	if (ret < 0)
 		return ret;
 
-	return qmc5883_set_mode(data, QMC5883_MODE_CONTINUOUS);
+	mutex_lock(&data->fifo_lock);
+	data->fifo_count = 0;
+	mutex_unlock(&data->fifo_lock);
+
+	return 0;
+}
+
+static int qmc5883_buffer_postdisable(struct iio_dev *indio_dev)
+{
+	qmc5883_stream_stop(iio_priv(indio_dev), indio_dev);
+
+	return 0;
+}
+
+static int qmc5883_buffer_predisable(struct iio_dev *indio_dev)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+	int ret;
+
+	ret = iio_triggered_buffer_predisable(indio_dev);
+
+	/* hand over what is left while the buffer is still attached */
+	cancel_delayed_work_sync(&data->fifo_work);
+	mutex_lock(&data->fifo_lock);
+	qmc5883_fifo_flush(indio_dev, data->fifo_count);
+	mutex_unlock(&data->fifo_lock);
+
+	return ret;
+}
+
+static const struct iio_buffer_setup_ops qmc5883_buffer_setup_ops = {
+	.preenable = qmc5883_buffer_preenable,
+	.postenable = iio_triggered_buffer_postenable,
+	.predisable = qmc5883_buffer_predisable,
+	.postdisable = qmc5883_buffer_postdisable,
+};
+
+static int qmc5883_tap_preenable(struct iio_dev *indio_dev)
+{
+	struct qmc5883_tap *tap = iio_priv(indio_dev);
+
+	return qmc5883_stream_start(tap->data, indio_dev, &tap->decim);
+}
+
+static int qmc5883_tap_postdisable(struct iio_dev *indio_dev)
+{
+	struct qmc5883_tap *tap = iio_priv(indio_dev);
+
+	qmc5883_stream_stop(tap->data, indio_dev);
+
+	return 0;
+}
+
+/* Taps have no FIFO of their own, the buffer watermark paces readers */
+static const struct iio_buffer_setup_ops qmc5883_tap_setup_ops = {
+	.preenable = qmc5883_tap_preenable,
+	.postenable = iio_triggered_buffer_postenable,
+	.predisable = iio_triggered_buffer_predisable,
+	.postdisable = qmc5883_tap_postdisable,
+};
+
+static int qmc5883_reg_access(struct iio_dev *indio_dev, unsigned int reg,
+			unsigned int writeval, unsigned int *readval)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+
+	if (readval)
+		return regmap_read(data->regmap, reg, readval);
+
+	/* Bypasses data->config, the driver won't know about the change */
+	return regmap_write(data->regmap, reg, writeval);
+}
+
+static void qmc5883_stats_show_hist(struct seq_file *s, const char *name,
+				const char *unit, atomic64_t *hist)
+{
+	int i;
+
+	seq_printf(s, "%s:\n", name);
+	for (i = 0; i < QMC5883_STATS_BUCKETS; i++)
+		seq_printf(s, "  < %llu %s: %lld\n", 1ULL << i, unit,
+			(long long)atomic64_read(&hist[i]));
+}
+
+static int qmc5883_stats_show(struct seq_file *s, void *unused)
+{
+	struct qmc5883_data *data = s->private;
+	struct qmc5883_stats *stats = &data->stats;
+	u64 samples = atomic64_read(&stats->samples);
+	u64 transfers = atomic64_read(&stats->transfers);
+	u64 bytes = atomic64_read(&stats->bytes);
+
+	seq_printf(s, "samples: %llu\n", samples);
+	seq_printf(s, "pushed: %lld\n",
+		(long long)atomic64_read(&stats->pushed));
+	seq_printf(s, "transfers: %llu\n", transfers);
+	seq_printf(s, "bytes: %llu\n", bytes);
+	if (samples) {
+		seq_printf(s, "transfers_per_sample_x100: %llu\n",
+			div64_u64(transfers * 100, samples));
+		seq_printf(s, "bytes_per_sample_x100: %llu\n",
+			div64_u64(bytes * 100, samples));
+	}
+	seq_printf(s, "data_skipped: %lld\n",
+		(long long)atomic64_read(&stats->skipped));
+	seq_printf(s, "overflow: %lld\n",
+		(long long)atomic64_read(&stats->overflow));
+	seq_printf(s, "range_switches: %lld\n",
+		(long long)atomic64_read(&stats->range_switches));
+	qmc5883_stats_show_hist(s, "push_latency", "us", stats->latency_hist);
+	qmc5883_stats_show_hist(s, "polls_per_read", "polls",
+				stats->polls_hist);
+
+	return 0;
+}
+
+static int qmc5883_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, qmc5883_stats_show, inode->i_private);
+}
+
+static const struct file_operations qmc5883_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = qmc5883_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static ssize_t qmc5883_stats_reset_write(struct file *file,
+					const char __user *buf,
+					size_t len, loff_t *ppos)
+{
+	struct qmc5883_data *data = file->private_data;
+	struct qmc5883_stats *stats = &data->stats;
+	int i;
+
+	atomic64_set(&stats->samples, 0);
+	atomic64_set(&stats->pushed, 0);
+	atomic64_set(&stats->transfers, 0);
+	atomic64_set(&stats->bytes, 0);
+	atomic64_set(&stats->skipped, 0);
+	atomic64_set(&stats->overflow, 0);
+	atomic64_set(&stats->range_switches, 0);
+	for (i = 0; i < QMC5883_STATS_BUCKETS; i++) {
+		atomic64_set(&stats->latency_hist[i], 0);
+		atomic64_set(&stats->polls_hist[i], 0);
+	}
+
+	return len;
+}
+
+static const struct file_operations qmc5883_stats_reset_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = qmc5883_stats_reset_write,
+	.llseek = noop_llseek,
+};
+
+/* Lives in the iio:deviceN debugfs directory, removed along with it */
+static void qmc5883_debugfs_init(struct iio_dev *indio_dev)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+	struct dentry *dir = iio_get_debugfs_dentry(indio_dev);
+
+	if (IS_ERR_OR_NULL(dir))
+		return;
+
+	debugfs_create_file("stats", S_IRUGO, dir, data,
+			&qmc5883_stats_fops);
+	debugfs_create_file("stats_reset", S_IWUSR, dir, data,
+			&qmc5883_stats_reset_fops);
+}
+
+static int qmc5883_event_slot(const struct iio_chan_spec *chan,
+			enum iio_event_type type,
+			enum iio_event_direction dir)
+{
+	if (chan->channel2 == IIO_MOD_ROOT_SUM_SQUARED_X_Y_Z) {
+		switch (type) {
+			case IIO_EV_TYPE_MAG_ADAPTIVE:
+				return QMC5883_EV_MAG;
+			case IIO_EV_TYPE_MAG:
+				return QMC5883_EV_OVERFLOW;
+			case IIO_EV_TYPE_THRESH:
+				return QMC5883_EV_RANGE;
+			default:
+				return -EINVAL;
+		}
+	}
+
+	switch (type) {
+		case IIO_EV_TYPE_THRESH:
+			return dir == IIO_EV_DIR_RISING ?
+				QMC5883_EV_RISING(chan->scan_index) :
+				QMC5883_EV_FALLING(chan->scan_index);
+		case IIO_EV_TYPE_ROC:
+			return QMC5883_EV_ROC(chan->scan_index);
+		default:
+			return -EINVAL;
+	}
+}
+
+static int qmc5883_read_event_config(struct iio_dev *indio_dev,
+				const struct iio_chan_spec *chan,
+				enum iio_event_type type,
+				enum iio_event_direction dir)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+	int slot = qmc5883_event_slot(chan, type, dir);
+
+	if (slot < 0)
+		return slot;
+
+	return test_bit(slot, &data->events.enabled);
+}
+
+static int qmc5883_write_event_config(struct iio_dev *indio_dev,
+				const struct iio_chan_spec *chan,
+				enum iio_event_type type,
+				enum iio_event_direction dir, int state)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+	int slot = qmc5883_event_slot(chan, type, dir);
+
+	if (slot < 0)
+		return slot;
+
+	mutex_lock(&data->read_lock);
+	if (state)
+		__set_bit(slot, &data->events.enabled);
+	else
+		__clear_bit(slot, &data->events.enabled);
+	__clear_bit(slot, &data->events.active);
+	data->events.primed = false;
+	mutex_unlock(&data->read_lock);
+
+	return 0;
+}
+
+static int qmc5883_read_event_value(struct iio_dev *indio_dev,
+				const struct iio_chan_spec *chan,
+				enum iio_event_type type,
+				enum iio_event_direction dir,
+				enum iio_event_info info,
+				int *val, int *val2)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+	int slot = qmc5883_event_slot(chan, type, dir);
+
+	if (slot < 0)
+		return slot;
+
+	mutex_lock(&data->read_lock);
+	*val = data->events.value[slot];
+	mutex_unlock(&data->read_lock);
+
+	return IIO_VAL_INT;
+}
+
+static int qmc5883_write_event_value(struct iio_dev *indio_dev,
+				const struct iio_chan_spec *chan,
+				enum iio_event_type type,
+				enum iio_event_direction dir,
+				enum iio_event_info info,
+				int val, int val2)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+	int slot = qmc5883_event_slot(chan, type, dir);
+
+	if (slot < 0)
+		return slot;
+
+	/* Thresholds compare against s16 samples, the others are positive */
+	if (type == IIO_EV_TYPE_THRESH ? val < S16_MIN || val > S16_MAX :
+	    val < 0)
+		return -EINVAL;
+
+	mutex_lock(&data->read_lock);
+	data->events.value[slot] = val;
+	mutex_unlock(&data->read_lock);
+
+	return 0;
 }
 
 static const struct iio_info qmc5883_info = {
@@ -513,33 +2477,186 @@ static const struct iio_info qmc5883_info = {
 	.read_raw = &qmc5883_read_raw,
 	.write_raw = &qmc5883_write_raw,
 	.write_raw_get_fmt = &qmc5883_write_raw_get_fmt,
+	.read_event_config = qmc5883_read_event_config,
+	.write_event_config = qmc5883_write_event_config,
+	.read_event_value = qmc5883_read_event_value,
+	.write_event_value = qmc5883_write_event_value,
+	.hwfifo_set_watermark = qmc5883_hwfifo_set_watermark,
+	.hwfifo_flush_to_buffer = qmc5883_hwfifo_flush_to_buffer,
+	.debugfs_reg_access = qmc5883_reg_access,
+};
+
+/* Taps only get samples through qmc5883_produce(), i.e. our triggers */
+static int qmc5883_tap_validate_trigger(struct iio_dev *indio_dev,
+					struct iio_trigger *trig)
+{
+	struct qmc5883_tap *tap = iio_priv(indio_dev);
+
+	if (trig != tap->data->drdy_trig && trig != tap->data->timer_trig)
+		return -EINVAL;
+
+	return 0;
+}
+
+static const struct iio_info qmc5883_tap_info = {
+	.attrs = &qmc5883_tap_group,
+	.validate_trigger = qmc5883_tap_validate_trigger,
 };
 
-static const unsigned long qmc5883_scan_masks[] = {0x7, 0};
+/* The heading is only computed when a buffer selects the second mask */
+static const unsigned long qmc5883_scan_masks[] = {0xF, 0x1F, 0};
+
+static void qmc5883_unregister_taps(struct qmc5883_data *data)
+{
+	while (data->n_taps) {
+		struct iio_dev *tap_dev = data->taps[--data->n_taps];
+
+		iio_device_unregister(tap_dev);
+		iio_triggered_buffer_cleanup(tap_dev);
+	}
+}
+
+/*
+ * Extra buffer devices "<name>-tapN" for consumers that want their own
+ * rate and watermark. They hang off our trigger and push the samples
+ * the main device reads, so they add no bus traffic.
+ */
+static int qmc5883_register_taps(struct iio_dev *indio_dev, const char *name)
+{
+	struct qmc5883_data *data = iio_priv(indio_dev);
+	struct iio_trigger *trig = data->drdy_trig ?: data->timer_trig;
+	struct iio_dev *tap_dev;
+	struct qmc5883_tap *tap;
+	u32 n_taps = 0;
+	int ret;
+
+	of_property_read_u32(data->dev->of_node, "qst,buffer-taps", &n_taps);
+	if (n_taps > QMC5883_MAX_TAPS) {
+		dev_err(data->dev, "at most %d buffer taps\n",
+			QMC5883_MAX_TAPS);
+		return -EINVAL;
+	}
+
+	while (data->n_taps < n_taps) {
+		tap_dev = devm_iio_device_alloc(data->dev, sizeof(*tap));
+		if (!tap_dev) {
+			ret = -ENOMEM;
+			goto err;
+		}
+
+		tap = iio_priv(tap_dev);
+		tap->data = data;
+		tap->decim.factor = 1;
+
+		tap_dev->dev.parent = data->dev;
+		tap_dev->name = devm_kasprintf(data->dev, GFP_KERNEL, "%s-tap%u",
+					name, data->n_taps);
+		if (!tap_dev->name) {
+			ret = -ENOMEM;
+			goto err;
+		}
+		tap_dev->info = &qmc5883_tap_info;
+		tap_dev->modes = INDIO_DIRECT_MODE;
+		tap_dev->channels = qmc5883_tap_channels;
+		tap_dev->num_channels = ARRAY_SIZE(qmc5883_tap_channels);
+		tap_dev->available_scan_masks = qmc5883_scan_masks;
+		tap_dev->trig = iio_trigger_get(trig);
+
+		ret = iio_triggered_buffer_setup(tap_dev,
+						qmc5883_pollfunc_store_time,
+						qmc5883_tap_trigger_handler,
+						&qmc5883_tap_setup_ops);
+		if (ret < 0)
+			goto err;
+
+		ret = iio_device_register(tap_dev);
+		if (ret < 0) {
+			iio_triggered_buffer_cleanup(tap_dev);
+			goto err;
+		}
+
+		data->taps[data->n_taps++] = tap_dev;
+	}
+
+	return 0;
+
+err:
+	qmc5883_unregister_taps(data);
+	return ret;
+}
 
 int qmc5883_common_suspend(struct device *dev)
 {
-	return qmc5883_set_mode(iio_priv(dev_get_drvdata(dev)),
-					QMC5883_MODE_STANDBY);
+	return pm_runtime_force_suspend(dev);
 }
 EXPORT_SYMBOL(qmc5883_common_suspend);
 
 int qmc5883_common_resume(struct device *dev)
 {
-	return qmc5883_set_mode(iio_priv(dev_get_drvdata(dev)),
-					QMC5883_MODE_CONTINUOUS);
+	return pm_runtime_force_resume(dev);
 }
 EXPORT_SYMBOL(qmc5883_common_resume);
 
+/*
+ * Runtime suspend puts the chip in standby behind the back of the cache,
+ * so the cache keeps the running configuration. Until resume, config
+ * writes only land in the cache and are restored from it afterwards.
+ */
+int qmc5883_common_runtime_suspend(struct device *dev)
+{
+	struct qmc5883_data *data = iio_priv(dev_get_drvdata(dev));
+	struct qmc5883_config cfg;
+	int ret;
+
+	mutex_lock(&data->lock);
+	regcache_cache_bypass(data->regmap, true);
+	cfg = data->config;
+	cfg.mode = QMC5883_MODE_STANDBY;
+	ret = regmap_write(data->regmap, QMC5883_CONTROL_REG_1,
+			qmc5883_ctrl1(&cfg));
+	regcache_cache_bypass(data->regmap, false);
+	if (!ret) {
+		regcache_cache_only(data->regmap, true);
+		regcache_mark_dirty(data->regmap);
+	}
+	mutex_unlock(&data->lock);
+
+	return ret;
+}
+EXPORT_SYMBOL(qmc5883_common_runtime_suspend);
+
+int qmc5883_common_runtime_resume(struct device *dev)
+{
+	struct qmc5883_data *data = iio_priv(dev_get_drvdata(dev));
+	int ret;
+
+	mutex_lock(&data->lock);
+	regcache_cache_only(data->regmap, false);
+	/*
+	 * A plain regcache_sync() goes in address order and would restart
+	 * conversions through CONTROL_REG_1 before CONTROL_REG_2 and PERIOD
+	 * are back, so restore those first and CONTROL_REG_1 last.
+	 */
+	ret = regcache_sync_region(data->regmap, QMC5883_CONTROL_REG_2,
+				QMC5883_PERIOD_REG);
+	if (!ret)
+		ret = regcache_sync_region(data->regmap, QMC5883_CONTROL_REG_1,
+					QMC5883_CONTROL_REG_1);
+	data->conv_epoch_ns = ktime_get_ns();
+	mutex_unlock(&data->lock);
+
+	return ret;
+}
+EXPORT_SYMBOL(qmc5883_common_runtime_resume);
+
 int qmc5883_common_probe(struct device *dev, struct regmap *regmap,
 			enum qmc5883_ids id, const char *name)
 {
 	struct qmc5883_data *data;
 	struct iio_dev *indio_dev;
+	u32 autosuspend_delay;
 	int ret;
 
-	pr_info("qmc5883_common_probe++\n");
-
 	indio_dev = devm_iio_device_alloc(dev, sizeof(*data));
 	if (!indio_dev)
 		return -ENOMEM;
@@ -552,40 +2669,107 @@ int qmc5883_common_probe(struct device *dev, struct regmap *regmap,
 	data->regmap = regmap;
 	data->variant = &qmc5883_chip_info_tbl[id];
 	mutex_init(&data->lock);
+	mutex_init(&data->read_lock);
+	seqlock_init(&data->sample_lock);
+	mutex_init(&data->fifo_lock);
+	data->fifo_watermark = 1;
+	INIT_DELAYED_WORK(&data->fifo_work, qmc5883_fifo_timeout_work);
+
+	qmc5883_calib_init(&data->calib);
+	data->decim.factor = 1;
+
+	data->sample_max_age_ms = QMC5883_SAMPLE_MAX_AGE_DEFAULT_MS;
+	of_property_read_u32(dev->of_node, "qst,sample-max-age-ms",
+			&data->sample_max_age_ms);
 
 	//Amar: TODO: Below call changes in latest kernel version
 	ret = of_iio_read_mount_matrix(dev, "mount-matrix", &data->orientation);
 	if (ret)
 		return ret;
 
+	ret = qmc5883_rotation_init(&data->rotation, &data->orientation);
+	if (ret) {
+		dev_err(dev, "invalid mount-matrix\n");
+		return ret;
+	}
+	if (of_property_read_bool(dev->of_node, "qst,apply-mount-matrix"))
+		data->proc_flags |= QMC5883_PROC_ROTATE;
+
 	indio_dev->name = name;
 	indio_dev->info = &qmc5883_info;
 	indio_dev->modes = INDIO_DIRECT_MODE;
 	indio_dev->channels = data->variant->channels;
-	indio_dev->num_channels = 4;
+	indio_dev->num_channels = data->variant->n_channels;
 	indio_dev->available_scan_masks = qmc5883_scan_masks;
 
 	ret = qmc5883_init(data);
 	if (ret < 0)
 		return ret;
 
-	ret = iio_triggered_buffer_setup(indio_dev, NULL,
-					qmc5883_trigger_handler, NULL);
-
+	/* The chip is converting now, idle it once nobody needs data */
+	ret = pm_runtime_set_active(dev);
 	if (ret < 0)
 		goto buffer_setup_err;
 
+	autosuspend_delay = QMC5883_AUTOSUSPEND_DELAY_MS;
+	of_property_read_u32(dev->of_node, "qst,autosuspend-delay-ms",
+			&autosuspend_delay);
+	pm_runtime_enable(dev);
+	pm_runtime_set_autosuspend_delay(dev, autosuspend_delay);
+	pm_runtime_use_autosuspend(dev);
+
+	/* The DRDY line is optional, fall back to polling without it */
+	data->irq = dev->of_node ? of_irq_get(dev->of_node, 0) : 0;
+	if (data->irq == -EPROBE_DEFER) {
+		ret = -EPROBE_DEFER;
+		goto pm_cleanup;
+	}
+
+	if (data->irq > 0)
+		ret = qmc5883_setup_drdy_trigger(indio_dev, name);
+	else
+		ret = qmc5883_setup_timer_trigger(indio_dev, name);
+	if (ret < 0)
+		goto pm_cleanup;
+
+	ret = iio_triggered_buffer_setup(indio_dev, qmc5883_pollfunc_store_time,
+					qmc5883_trigger_handler,
+					&qmc5883_buffer_setup_ops);
+
+	if (ret < 0)
+		goto trigger_cleanup;
+
+	indio_dev->buffer->attrs = qmc5883_fifo_attributes;
+
 	ret = iio_device_register(indio_dev);
 	if (ret < 0)
 		goto buffer_cleanup;
 
-	pr_info("qmc5883_common_probei-2++\n");
-	
+	ret = qmc5883_register_taps(indio_dev, name);
+	if (ret < 0)
+		goto device_cleanup;
+
+	qmc5883_debugfs_init(indio_dev);
+
 	return 0;
 
+device_cleanup:
+	iio_device_unregister(indio_dev);
+
 buffer_cleanup:
 	iio_triggered_buffer_cleanup(indio_dev);
 
+trigger_cleanup:
+	if (data->drdy_trig)
+		iio_trigger_unregister(data->drdy_trig);
+	if (data->timer_trig)
+		iio_trigger_unregister(data->timer_trig);
+
+pm_cleanup:
+	pm_runtime_disable(dev);
+	pm_runtime_set_suspended(dev);
+	pm_runtime_dont_use_autosuspend(dev);
+
 buffer_setup_err:
 	qmc5883_set_mode(iio_priv(indio_dev), QMC5883_MODE_STANDBY);
 	return ret;
@@ -595,9 +2779,19 @@ EXPORT_SYMBOL(qmc5883_common_probe);
 void qmc5883_common_remove(struct device *dev)
 {
 	struct iio_dev *indio_dev = dev_get_drvdata(dev);
+	struct qmc5883_data *data = iio_priv(indio_dev);
 
+	qmc5883_unregister_taps(data);
 	iio_device_unregister(indio_dev);
 	iio_triggered_buffer_cleanup(indio_dev);
+	if (data->drdy_trig)
+		iio_trigger_unregister(data->drdy_trig);
+	if (data->timer_trig)
+		iio_trigger_unregister(data->timer_trig);
+
+	pm_runtime_disable(dev);
+	pm_runtime_set_suspended(dev);
+	pm_runtime_dont_use_autosuspend(dev);
 
 	/* push to standby mode to save power */
 	qmc5883_set_mode(iio_priv(indio_dev), QMC5883_MODE_STANDBY);
@@ -0,0 +1,414 @@
+/*
+ * Register-level QMC5883L emulator behind a virtual I2C adapter.
+ *
+ * Copyright (C) 2022 GiraffAI
+ *
+ * Author: Amarnath Revanna <amarnath.revanna@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Every emulated sensor gets its own adapter with a "qmc5883" client at
+ * 0x0d, so the regular qmc5883_i2c driver binds to it unchanged. The
+ * model converts at the programmed ODR and keeps DRDY, OVL and DOR, the
+ * temperature output and the roll-over pointer the way the chip does.
+ * The field is either a per-axis sine with noise described by module
+ * parameters, or a recorded trace loaded through request_firmware().
+ */
+
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/i2c.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/firmware.h>
+#include <linux/fixp-arith.h>
+#include <linux/random.h>
+#include <asm/unaligned.h>
+
+#include "qmc5883.h"
+
+#define QMC5883_EMUL_ADDR		0x0d
+#define QMC5883_EMUL_NREGS		(QMC5883_CHIP_ID_REG + 1)
+#define QMC5883_EMUL_CHIP_ID		0xff
+#define QMC5883_EMUL_MAX_DEVICES	64
+
+/* LSB per gauss for the 2G and 8G ranges, 100 LSB per degree Celsius */
+static const int qmc5883_emul_lsb_per_gauss[] = { 12000, 3000 };
+static const int qmc5883_emul_odr_hz[] = { 10, 50, 100, 200 };
+
+static unsigned int devices = 1;
+module_param(devices, uint, S_IRUGO);
+MODULE_PARM_DESC(devices, "number of emulated sensors (max 64)");
+
+static int offset_mg[3] = { 200, -50, 400 };
+static int n_offset_mg = 3;
+module_param_array(offset_mg, int, &n_offset_mg, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(offset_mg, "static field per axis in milligauss");
+
+static int amplitude_mg = 300;
+module_param(amplitude_mg, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(amplitude_mg, "sine amplitude in milligauss");
+
+static unsigned int period_ms = 4000;
+module_param(period_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(period_ms, "sine period in milliseconds, 0 for a static field");
+
+static unsigned int noise_mg = 2;
+module_param(noise_mg, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(noise_mg, "peak uniform noise in milligauss");
+
+static int temp_cdeg = 2500;
+module_param(temp_cdeg, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(temp_cdeg, "temperature in 1/100 degree Celsius");
+
+static char *trace;
+module_param(trace, charp, S_IRUGO);
+MODULE_PARM_DESC(trace,
+	"firmware file with little-endian s16 X,Y,Z milligauss triples, one per conversion");
+
+struct qmc5883_emul {
+	struct i2c_adapter adap;
+	struct i2c_client *client;
+	struct hrtimer timer;
+	/* protects everything below against the conversion timer */
+	spinlock_t lock;
+	u8 regs[QMC5883_EMUL_NREGS];
+	u8 ptr;
+	u64 conversions;
+	unsigned int index;
+};
+
+static const struct firmware *qmc5883_emul_trace;
+static struct qmc5883_emul **qmc5883_emul_devs;
+
+static u64 qmc5883_emul_period_ns(struct qmc5883_emul *emul)
+{
+	u8 odr = (emul->regs[QMC5883_CONTROL_REG_1] & QMC5883_RATE_MASK) >>
+		QMC5883_RATE_OFFSET;
+
+	return NSEC_PER_SEC / qmc5883_emul_odr_hz[odr];
+}
+
+static bool qmc5883_emul_running(struct qmc5883_emul *emul)
+{
+	return (emul->regs[QMC5883_CONTROL_REG_1] & QMC5883_MODE_MASK) ==
+		QMC5883_MODE_CONTINUOUS;
+}
+
+/* Field seen by @axis at conversion @n, in milligauss */
+static int qmc5883_emul_field(struct qmc5883_emul *emul, int axis, u64 n)
+{
+	int field, noise;
+
+	if (qmc5883_emul_trace) {
+		u32 entries = qmc5883_emul_trace->size / 6;
+		/* sensors play the trace from different offsets */
+		u64 pos = n + emul->index * 97;
+		const u8 *entry = qmc5883_emul_trace->data +
+				do_div(pos, entries) * 6;
+
+		field = (s16)get_unaligned_le16(entry + 2 * axis);
+	} else {
+		field = offset_mg[axis];
+		if (period_ms) {
+			u64 ms = div_u64(n * qmc5883_emul_period_ns(emul),
+					NSEC_PER_MSEC);
+			u32 rem = do_div(ms, period_ms);
+			/* axes 120 degrees apart, sensors 15 degrees apart */
+			int deg = div_u64((u64)rem * 360, period_ms) +
+				axis * 120 + emul->index * 15;
+
+			field += (s64)amplitude_mg * fixp_sin32(deg % 360) >> 31;
+		}
+	}
+
+	if (noise_mg) {
+		noise = prandom_u32() % (2 * noise_mg + 1);
+		field += noise - noise_mg;
+	}
+
+	return field;
+}
+
+/* Latch a new conversion into the output registers, with emul->lock held */
+static void qmc5883_emul_convert(struct qmc5883_emul *emul)
+{
+	u8 range = (emul->regs[QMC5883_CONTROL_REG_1] &
+		QMC5883_RANGE_GAIN_MASK) >> QMC5883_RANGE_GAIN_OFFSET;
+	u8 status = emul->regs[QMC5883_STATUS_REG];
+	bool overflow = false;
+	int axis;
+
+	if (range >= ARRAY_SIZE(qmc5883_emul_lsb_per_gauss))
+		range = 0;
+
+	for (axis = 0; axis < 3; axis++) {
+		s64 raw = (s64)qmc5883_emul_field(emul, axis,
+						emul->conversions) *
+			qmc5883_emul_lsb_per_gauss[range] / 1000;
+
+		if (raw > S16_MAX || raw < S16_MIN) {
+			overflow = true;
+			raw = clamp_t(s64, raw, S16_MIN, S16_MAX);
+		}
+		put_unaligned_le16((u16)raw, &emul->regs[2 * axis]);
+	}
+	put_unaligned_le16((u16)temp_cdeg,
+			&emul->regs[QMC5883_TEMP_OUT_REG_LOW]);
+
+	/* DOR: the previous sample was never read */
+	if (status & QMC5883_DATA_READY)
+		status |= QMC5883_DATA_SKIPPED;
+	status |= QMC5883_DATA_READY;
+	if (overflow)
+		status |= QMC5883_OVERFLOW;
+	else
+		status &= ~QMC5883_OVERFLOW;
+	emul->regs[QMC5883_STATUS_REG] = status;
+
+	emul->conversions++;
+}
+
+static enum hrtimer_restart qmc5883_emul_timer(struct hrtimer *timer)
+{
+	struct qmc5883_emul *emul = container_of(timer, struct qmc5883_emul,
+						timer);
+	enum hrtimer_restart restart = HRTIMER_NORESTART;
+	unsigned long flags;
+
+	spin_lock_irqsave(&emul->lock, flags);
+	if (qmc5883_emul_running(emul)) {
+		qmc5883_emul_convert(emul);
+		hrtimer_forward_now(timer,
+				ns_to_ktime(qmc5883_emul_period_ns(emul)));
+		restart = HRTIMER_RESTART;
+	}
+	spin_unlock_irqrestore(&emul->lock, flags);
+
+	return restart;
+}
+
+/* Called with emul->lock held, returns true if conversions (re)start */
+static bool qmc5883_emul_write(struct qmc5883_emul *emul, u8 reg, u8 val)
+{
+	switch (reg) {
+	case QMC5883_CONTROL_REG_1:
+		emul->regs[reg] = val;
+		return qmc5883_emul_running(emul);
+	case QMC5883_CONTROL_REG_2:
+		if (val & QMC5883_SOFT_RST) {
+			memset(emul->regs, 0, QMC5883_CHIP_ID_REG);
+			return false;
+		}
+		emul->regs[reg] = val;
+		return false;
+	case QMC5883_PERIOD_REG:
+		emul->regs[reg] = val;
+		return false;
+	default:
+		/* read only */
+		return false;
+	}
+}
+
+static u8 qmc5883_emul_next_ptr(struct qmc5883_emul *emul, u8 ptr)
+{
+	if (emul->regs[QMC5883_CONTROL_REG_2] & QMC5883_ROL_PNT &&
+	    ptr == QMC5883_STATUS_REG)
+		return QMC5883_DATA_OUT_LSB_REGS;
+
+	return ptr + 1 < QMC5883_EMUL_NREGS ? ptr + 1 : 0;
+}
+
+static int qmc5883_emul_xfer(struct i2c_adapter *adap, struct i2c_msg *msgs,
+			int num)
+{
+	struct qmc5883_emul *emul = i2c_get_adapdata(adap);
+	bool restart = false;
+	unsigned long flags;
+	int i, j;
+
+	spin_lock_irqsave(&emul->lock, flags);
+	for (i = 0; i < num; i++) {
+		struct i2c_msg *msg = &msgs[i];
+		bool data_read = false;
+
+		if (msg->addr != QMC5883_EMUL_ADDR) {
+			spin_unlock_irqrestore(&emul->lock, flags);
+			return -ENXIO;
+		}
+
+		if (msg->flags & I2C_M_RD) {
+			for (j = 0; j < msg->len; j++) {
+				msg->buf[j] = emul->regs[emul->ptr];
+				if (emul->ptr < QMC5883_STATUS_REG)
+					data_read = true;
+				emul->ptr = qmc5883_emul_next_ptr(emul,
+								emul->ptr);
+			}
+			/*
+			 * The status byte is latched for the whole transfer,
+			 * DRDY and DOR only drop once the read is over.
+			 */
+			if (data_read)
+				emul->regs[QMC5883_STATUS_REG] &=
+					~(QMC5883_DATA_READY |
+					  QMC5883_DATA_SKIPPED);
+			continue;
+		}
+
+		if (!msg->len)
+			continue;
+		emul->ptr = msg->buf[0] % QMC5883_EMUL_NREGS;
+		for (j = 1; j < msg->len; j++) {
+			restart |= qmc5883_emul_write(emul, emul->ptr,
+						msg->buf[j]);
+			emul->ptr = qmc5883_emul_next_ptr(emul, emul->ptr);
+		}
+	}
+
+	/* a CONTROL_REG_1 write restarts the conversion cycle */
+	if (restart)
+		hrtimer_start(&emul->timer,
+			ns_to_ktime(qmc5883_emul_period_ns(emul)),
+			HRTIMER_MODE_REL);
+	spin_unlock_irqrestore(&emul->lock, flags);
+
+	return num;
+}
+
+static u32 qmc5883_emul_func(struct i2c_adapter *adap)
+{
+	return I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL;
+}
+
+static const struct i2c_algorithm qmc5883_emul_algo = {
+	.master_xfer = qmc5883_emul_xfer,
+	.functionality = qmc5883_emul_func,
+};
+
+static struct qmc5883_emul *qmc5883_emul_create(unsigned int index)
+{
+	struct qmc5883_emul *emul;
+	int ret;
+
+	emul = kzalloc(sizeof(*emul), GFP_KERNEL);
+	if (!emul)
+		return ERR_PTR(-ENOMEM);
+
+	emul->index = index;
+	emul->regs[QMC5883_CHIP_ID_REG] = QMC5883_EMUL_CHIP_ID;
+	spin_lock_init(&emul->lock);
+	hrtimer_init(&emul->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	emul->timer.function = qmc5883_emul_timer;
+
+	emul->adap.owner = THIS_MODULE;
+	emul->adap.algo = &qmc5883_emul_algo;
+	snprintf(emul->adap.name, sizeof(emul->adap.name),
+		"qmc5883 emulator %u", index);
+	i2c_set_adapdata(&emul->adap, emul);
+
+	ret = i2c_add_adapter(&emul->adap);
+	if (ret < 0) {
+		kfree(emul);
+		return ERR_PTR(ret);
+	}
+
+	return emul;
+}
+
+static void qmc5883_emul_destroy(struct qmc5883_emul *emul)
+{
+	if (emul->client)
+		i2c_unregister_device(emul->client);
+	i2c_del_adapter(&emul->adap);
+	hrtimer_cancel(&emul->timer);
+	kfree(emul);
+}
+
+static int __init qmc5883_emul_init(void)
+{
+	struct i2c_board_info info = {
+		I2C_BOARD_INFO("qmc5883", QMC5883_EMUL_ADDR),
+	};
+	struct qmc5883_emul *emul;
+	unsigned int i;
+	int ret;
+
+	if (!devices || devices > QMC5883_EMUL_MAX_DEVICES)
+		return -EINVAL;
+
+	qmc5883_emul_devs = kcalloc(devices, sizeof(*qmc5883_emul_devs),
+				GFP_KERNEL);
+	if (!qmc5883_emul_devs)
+		return -ENOMEM;
+
+	for (i = 0; i < devices; i++) {
+		emul = qmc5883_emul_create(i);
+		if (IS_ERR(emul)) {
+			ret = PTR_ERR(emul);
+			goto err_destroy;
+		}
+		qmc5883_emul_devs[i] = emul;
+	}
+
+	/* Load the trace before any driver can start conversions */
+	if (trace) {
+		ret = request_firmware(&qmc5883_emul_trace, trace,
+				&qmc5883_emul_devs[0]->adap.dev);
+		if (!ret && qmc5883_emul_trace->size < 6) {
+			release_firmware(qmc5883_emul_trace);
+			qmc5883_emul_trace = NULL;
+			ret = -EINVAL;
+		}
+		if (ret < 0) {
+			pr_err("qmc5883_emul: cannot load trace %s\n", trace);
+			goto err_destroy;
+		}
+	}
+
+	for (i = 0; i < devices; i++) {
+		emul = qmc5883_emul_devs[i];
+		emul->client = i2c_new_device(&emul->adap, &info);
+		if (!emul->client) {
+			ret = -ENODEV;
+			i = devices;
+			goto err_destroy;
+		}
+	}
+
+	return 0;
+
+err_destroy:
+	while (i--)
+		qmc5883_emul_destroy(qmc5883_emul_devs[i]);
+	kfree(qmc5883_emul_devs);
+	release_firmware(qmc5883_emul_trace);
+	return ret;
+}
+module_init(qmc5883_emul_init);
+
+static void __exit qmc5883_emul_exit(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < devices; i++)
+		qmc5883_emul_destroy(qmc5883_emul_devs[i]);
+	kfree(qmc5883_emul_devs);
+	release_firmware(qmc5883_emul_trace);
+}
+module_exit(qmc5883_emul_exit);
+
+MODULE_AUTHOR("Amarnath Revanna");
+MODULE_DESCRIPTION("QMC5883 register-level emulator");
+MODULE_LICENSE("GPL");
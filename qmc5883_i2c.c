@@ -36,7 +36,9 @@ static const struct regmap_range qmc5883_writable_ranges[] = {
 };
 
 static const struct regmap_range qmc5883_volatile_ranges[] = {
-	regmap_reg_range(QMC5883_DATA_OUT_LSB_REGS, QMC5883_TEMP_OUT_REG_HIGH)
+	regmap_reg_range(QMC5883_DATA_OUT_LSB_REGS, QMC5883_TEMP_OUT_REG_HIGH),
+	/* A flat cache has no notion of unread registers, read these live */
+	regmap_reg_range(QMC5883_RESERVED_REG, QMC5883_CHIP_ID_REG),
 };
 
 static const struct regmap_access_table qmc5883_readable_table = {
@@ -62,7 +64,9 @@ static const struct regmap_config qmc5883_i2c_regmap_config = {
 	.wr_table = &qmc5883_writable_table,
 	.volatile_table = &qmc5883_volatile_table,
 
-	.cache_type = REGCACHE_RBTREE,
+	/* 14 registers, a flat array beats an rbtree lookup */
+	.max_register = QMC5883_CHIP_ID_REG,
+	.cache_type = REGCACHE_FLAT,
 };
 
 static int qmc5883_i2c_probe(struct i2c_client *cli,
@@ -94,6 +98,8 @@ static int qmc5883_i2c_remove(struct i2c_client *cli)
 {
 	pr_info("Amar: qmc5883_i2c_remove--\n");
 
+	qmc5883_common_remove(&cli->dev);
+
 	return 0;
 }
 
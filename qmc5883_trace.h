@@ -0,0 +1,131 @@
+/*
+ * Tracepoints for the QMC5883 magnetometer driver
+ *
+ * Copyright (C) 2022 GiraffAI
+ * Author: Amarnath Revanna <amarnath.revanna@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM qmc5883
+
+#if !defined(QMC5883_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define QMC5883_TRACE_H
+
+#include <linux/device.h>
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(qmc5883_trigger,
+	TP_PROTO(struct device *dev, s64 timestamp),
+	TP_ARGS(dev, timestamp),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(s64, timestamp)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->timestamp = timestamp;
+	),
+	TP_printk("%s timestamp=%lld", __get_str(dev), __entry->timestamp)
+);
+
+TRACE_EVENT(qmc5883_poll,
+	TP_PROTO(struct device *dev, int polls, int ret),
+	TP_ARGS(dev, polls, ret),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(int, polls)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->polls = polls;
+		__entry->ret = ret;
+	),
+	TP_printk("%s polls=%d ret=%d", __get_str(dev), __entry->polls,
+		__entry->ret)
+);
+
+TRACE_EVENT(qmc5883_burst_start,
+	TP_PROTO(struct device *dev, unsigned int reg, size_t len),
+	TP_ARGS(dev, reg, len),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(unsigned int, reg)
+		__field(size_t, len)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->reg = reg;
+		__entry->len = len;
+	),
+	TP_printk("%s reg=0x%02x len=%zu", __get_str(dev), __entry->reg,
+		__entry->len)
+);
+
+TRACE_EVENT(qmc5883_burst_end,
+	TP_PROTO(struct device *dev, size_t len, u8 status, int ret),
+	TP_ARGS(dev, len, status, ret),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(size_t, len)
+		__field(u8, status)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->len = len;
+		__entry->status = status;
+		__entry->ret = ret;
+	),
+	TP_printk("%s len=%zu status=0x%02x ret=%d", __get_str(dev),
+		__entry->len, __entry->status, __entry->ret)
+);
+
+TRACE_EVENT(qmc5883_push,
+	TP_PROTO(struct device *dev, s64 timestamp, unsigned int count),
+	TP_ARGS(dev, timestamp, count),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(s64, timestamp)
+		__field(unsigned int, count)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->timestamp = timestamp;
+		__entry->count = count;
+	),
+	TP_printk("%s timestamp=%lld count=%u", __get_str(dev),
+		__entry->timestamp, __entry->count)
+);
+
+TRACE_EVENT(qmc5883_config,
+	TP_PROTO(struct device *dev, unsigned int reg, unsigned int val,
+		int ret),
+	TP_ARGS(dev, reg, val, ret),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(unsigned int, reg)
+		__field(unsigned int, val)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->reg = reg;
+		__entry->val = val;
+		__entry->ret = ret;
+	),
+	TP_printk("%s reg=0x%02x val=0x%02x ret=%d", __get_str(dev),
+		__entry->reg, __entry->val, __entry->ret)
+);
+
+#endif /* QMC5883_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE qmc5883_trace
+#include <trace/define_trace.h>
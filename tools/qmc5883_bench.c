@@ -0,0 +1,451 @@
+/*
+ * End-to-end latency and throughput benchmark for the QMC5883 IIO buffer.
+ *
+ * Copyright (C) 2022 GiraffAI
+ *
+ * Author: Amarnath Revanna <amarnath.revanna@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Enables every scan element of a qmc5883 device, attaches the driver's
+ * own trigger and reads /dev/iio:deviceN. Reports sustained samples/s,
+ * kernel timestamp to userspace receipt latency percentiles, gaps in
+ * the timestamp sequence and the CPU time spent by the reader. Works
+ * the same on real hardware and on qmc5883_emul.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define IIO_DIR		"/sys/bus/iio/devices"
+#define MAX_ELEMENTS	16
+
+struct scan_element {
+	char name[64];
+	int index;
+	int bytes;
+	int offset;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static int write_sysfs(const char *dir, const char *file, const char *val)
+{
+	char path[512];
+	FILE *f;
+	int ret = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	f = fopen(path, "w");
+	if (!f)
+		return -errno;
+	if (fputs(val, f) < 0)
+		ret = -EIO;
+	if (fclose(f))
+		ret = -errno;
+
+	return ret;
+}
+
+static int read_sysfs(const char *dir, const char *file, char *buf,
+		size_t len)
+{
+	char path[512];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+	if (!fgets(buf, len, f)) {
+		fclose(f);
+		return -EIO;
+	}
+	fclose(f);
+	buf[strcspn(buf, "\n")] = '\0';
+
+	return 0;
+}
+
+/* Find the first iio:deviceN whose name matches, -1 if none */
+static int find_device(const char *name)
+{
+	char dir[sizeof(IIO_DIR) + NAME_MAX + 1], buf[64];
+	struct dirent *ent;
+	int id = -1;
+	DIR *d;
+
+	d = opendir(IIO_DIR);
+	if (!d)
+		return -1;
+
+	while ((ent = readdir(d))) {
+		if (sscanf(ent->d_name, "iio:device%d", &id) != 1)
+			continue;
+		snprintf(dir, sizeof(dir), IIO_DIR "/%s", ent->d_name);
+		if (!read_sysfs(dir, "name", buf, sizeof(buf)) &&
+		    !strcmp(buf, name))
+			break;
+		id = -1;
+	}
+	closedir(d);
+
+	return id;
+}
+
+/* The driver names its triggers <name>-dev<N> or <name>-timer-dev<N> */
+static int find_trigger(const char *name, int id, char *trig, size_t len)
+{
+	char dir[sizeof(IIO_DIR) + NAME_MAX + 1], buf[64], suffix[32];
+	struct dirent *ent;
+	int ret = -1;
+	DIR *d;
+
+	snprintf(suffix, sizeof(suffix), "-dev%d", id);
+	d = opendir(IIO_DIR);
+	if (!d)
+		return -1;
+
+	while ((ent = readdir(d))) {
+		size_t blen, slen = strlen(suffix);
+
+		if (strncmp(ent->d_name, "trigger", 7))
+			continue;
+		snprintf(dir, sizeof(dir), IIO_DIR "/%s", ent->d_name);
+		if (read_sysfs(dir, "name", buf, sizeof(buf)))
+			continue;
+		blen = strlen(buf);
+		if (!strncmp(buf, name, strlen(name)) && blen > slen &&
+		    !strcmp(buf + blen - slen, suffix)) {
+			snprintf(trig, len, "%s", buf);
+			ret = 0;
+			break;
+		}
+	}
+	closedir(d);
+
+	return ret;
+}
+
+static int cmp_element(const void *a, const void *b)
+{
+	return ((const struct scan_element *)a)->index -
+		((const struct scan_element *)b)->index;
+}
+
+/* Enable every scan element and lay them out like the IIO core does */
+static int setup_scan(const char *devdir, struct scan_element *el,
+		int *count, int *sample_bytes)
+{
+	char dir[512], file[160], buf[64];
+	struct dirent *ent;
+	int n = 0, offset = 0, i;
+	DIR *d;
+
+	snprintf(dir, sizeof(dir), "%s/scan_elements", devdir);
+	d = opendir(dir);
+	if (!d)
+		return -errno;
+
+	while ((ent = readdir(d)) && n < MAX_ELEMENTS) {
+		size_t len = strlen(ent->d_name);
+		char endian, sign;
+		int bits, storage, shift;
+
+		if (len < 4 || strcmp(ent->d_name + len - 3, "_en"))
+			continue;
+		snprintf(el[n].name, sizeof(el[n].name), "%.*s",
+			(int)(len - 3), ent->d_name);
+
+		if (write_sysfs(dir, ent->d_name, "1"))
+			continue;
+
+		snprintf(file, sizeof(file), "%s_index", el[n].name);
+		if (read_sysfs(dir, file, buf, sizeof(buf)))
+			continue;
+		el[n].index = atoi(buf);
+
+		snprintf(file, sizeof(file), "%s_type", el[n].name);
+		if (read_sysfs(dir, file, buf, sizeof(buf)) ||
+		    sscanf(buf, "%ce:%c%d/%d>>%d", &endian, &sign, &bits,
+			   &storage, &shift) != 5)
+			continue;
+		el[n].bytes = storage / 8;
+		n++;
+	}
+	closedir(d);
+
+	qsort(el, n, sizeof(*el), cmp_element);
+	for (i = 0; i < n; i++) {
+		if (offset % el[i].bytes)
+			offset += el[i].bytes - offset % el[i].bytes;
+		el[i].offset = offset;
+		offset += el[i].bytes;
+	}
+	/* the sample is padded to its largest element, i.e. the timestamp */
+	if (n && offset % 8)
+		offset += 8 - offset % 8;
+
+	*count = n;
+	*sample_bytes = offset;
+
+	return n ? 0 : -ENOENT;
+}
+
+static clockid_t timestamp_clock(const char *devdir)
+{
+	char buf[32];
+
+	if (read_sysfs(devdir, "current_timestamp_clock", buf, sizeof(buf)))
+		return CLOCK_REALTIME;
+	if (!strcmp(buf, "monotonic"))
+		return CLOCK_MONOTONIC;
+	if (!strcmp(buf, "monotonic_raw"))
+		return CLOCK_MONOTONIC_RAW;
+	if (!strcmp(buf, "boottime"))
+		return CLOCK_BOOTTIME;
+
+	return CLOCK_REALTIME;
+}
+
+static int64_t now_ns(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_s64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int64_t percentile(const int64_t *v, size_t n, double p)
+{
+	size_t i = (size_t)(p * (n - 1));
+
+	return n ? v[i] : 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -n <name>     device name (default qmc5883)\n"
+		"  -d <index>    use iio:device<index> instead of looking up -n\n"
+		"  -t <trigger>  trigger name (default: the driver's own)\n"
+		"  -f <hz>       sampling frequency to set\n"
+		"  -w <samples>  buffer watermark (default 1)\n"
+		"  -l <samples>  buffer length (default 128)\n"
+		"  -b <samples>  samples per read() (default watermark)\n"
+		"  -s <seconds>  duration (default 10)\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *name = "qmc5883", *trigger = NULL, *freq = NULL;
+	int watermark = 1, length = 128, block = 0, seconds = 10;
+	struct scan_element el[MAX_ELEMENTS];
+	char devdir[256], devnode[64], trig[64], devname[64], buf[64];
+	int64_t *lat = NULL, start, end, prev_ts = 0, period_ns = 0;
+	size_t nlat = 0, cap = 0, gaps = 0, missed = 0;
+	int id = -1, fd, count = 0, sample_bytes = 0, ts_off = -1, i, c;
+	struct rusage ru;
+	unsigned char *data;
+	clockid_t clk;
+	double cpu;
+
+	while ((c = getopt(argc, argv, "n:d:t:f:w:l:b:s:h")) != -1) {
+		switch (c) {
+		case 'n': name = optarg; break;
+		case 'd': id = atoi(optarg); break;
+		case 't': trigger = optarg; break;
+		case 'f': freq = optarg; break;
+		case 'w': watermark = atoi(optarg); break;
+		case 'l': length = atoi(optarg); break;
+		case 'b': block = atoi(optarg); break;
+		case 's': seconds = atoi(optarg); break;
+		default: usage(argv[0]); return c == 'h' ? 0 : 1;
+		}
+	}
+	if (watermark < 1 || length < watermark || seconds < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (block < 1)
+		block = watermark;
+
+	/* Emulated sensors all share one name, -d picks one of them */
+	if (id < 0) {
+		id = find_device(name);
+		if (id < 0) {
+			fprintf(stderr, "no IIO device named %s\n", name);
+			return 1;
+		}
+	}
+	snprintf(devdir, sizeof(devdir), IIO_DIR "/iio:device%d", id);
+	if (read_sysfs(devdir, "name", devname, sizeof(devname))) {
+		fprintf(stderr, "no IIO device %d\n", id);
+		return 1;
+	}
+	name = devname;
+	snprintf(devnode, sizeof(devnode), "/dev/iio:device%d", id);
+
+	if (!trigger) {
+		if (find_trigger(name, id, trig, sizeof(trig))) {
+			fprintf(stderr, "no %s trigger for device %d\n",
+				name, id);
+			return 1;
+		}
+		trigger = trig;
+	}
+
+	/* start from a disabled buffer in case a previous run was killed */
+	write_sysfs(devdir, "buffer/enable", "0");
+
+	if (freq && write_sysfs(devdir, "in_magn_sampling_frequency", freq)) {
+		fprintf(stderr, "cannot set sampling frequency %s\n", freq);
+		return 1;
+	}
+	if (!read_sysfs(devdir, "in_magn_sampling_frequency", buf,
+			sizeof(buf)) && atof(buf) > 0)
+		period_ns = (int64_t)(1e9 / atof(buf));
+	/* only every decimation-th conversion is pushed */
+	if (period_ns && !read_sysfs(devdir, "decimation", buf, sizeof(buf)) &&
+	    atoi(buf) > 1)
+		period_ns *= atoi(buf);
+
+	if (setup_scan(devdir, el, &count, &sample_bytes)) {
+		fprintf(stderr, "cannot enable scan elements\n");
+		return 1;
+	}
+	for (i = 0; i < count; i++)
+		if (!strcmp(el[i].name, "in_timestamp"))
+			ts_off = el[i].offset;
+	if (ts_off < 0) {
+		fprintf(stderr, "device has no timestamp channel\n");
+		return 1;
+	}
+
+	snprintf(buf, sizeof(buf), "%d", length);
+	if (write_sysfs(devdir, "trigger/current_trigger", trigger) ||
+	    write_sysfs(devdir, "buffer/length", buf)) {
+		fprintf(stderr, "cannot set trigger %s or length\n", trigger);
+		return 1;
+	}
+	snprintf(buf, sizeof(buf), "%d", watermark);
+	write_sysfs(devdir, "buffer/watermark", buf);
+
+	data = malloc((size_t)block * sample_bytes);
+	if (!data)
+		return 1;
+
+	fd = open(devnode, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		perror(devnode);
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	if (write_sysfs(devdir, "buffer/enable", "1")) {
+		fprintf(stderr, "cannot enable buffer\n");
+		return 1;
+	}
+
+	clk = timestamp_clock(devdir);
+	start = now_ns(CLOCK_MONOTONIC);
+	end = start + (int64_t)seconds * 1000000000LL;
+
+	while (!stop && now_ns(CLOCK_MONOTONIC) < end) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		int64_t rx;
+		ssize_t n;
+
+		if (poll(&pfd, 1, 1000) <= 0)
+			continue;
+
+		n = read(fd, data, (size_t)block * sample_bytes);
+		if (n <= 0)
+			continue;
+		rx = now_ns(clk);
+
+		for (i = 0; i < n / sample_bytes; i++) {
+			int64_t ts;
+
+			memcpy(&ts, data + i * sample_bytes + ts_off, sizeof(ts));
+
+			if (nlat == cap) {
+				cap = cap ? cap * 2 : 4096;
+				lat = realloc(lat, cap * sizeof(*lat));
+				if (!lat)
+					return 1;
+			}
+			lat[nlat++] = rx - ts;
+
+			/* a hole longer than 1.5 periods means lost samples */
+			if (prev_ts && period_ns &&
+			    ts - prev_ts > period_ns + period_ns / 2) {
+				gaps++;
+				missed += (ts - prev_ts + period_ns / 2) /
+					period_ns - 1;
+			}
+			prev_ts = ts;
+		}
+	}
+
+	end = now_ns(CLOCK_MONOTONIC);
+	write_sysfs(devdir, "buffer/enable", "0");
+	close(fd);
+
+	getrusage(RUSAGE_SELF, &ru);
+	cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+
+	qsort(lat, nlat, sizeof(*lat), cmp_s64);
+
+	printf("device:        %s (iio:device%d)\n", name, id);
+	printf("trigger:       %s\n", trigger);
+	printf("sample bytes:  %d, watermark %d, block %d\n",
+		sample_bytes, watermark, block);
+	printf("samples:       %zu in %.3f s\n", nlat, (end - start) / 1e9);
+	printf("rate:          %.1f samples/s\n", nlat * 1e9 / (end - start));
+	printf("latency us:    p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+		percentile(lat, nlat, 0.50) / 1e3,
+		percentile(lat, nlat, 0.99) / 1e3,
+		percentile(lat, nlat, 0.999) / 1e3,
+		nlat ? lat[nlat - 1] / 1e3 : 0.0);
+	printf("gaps:          %zu (%zu samples missed)\n", gaps, missed);
+	printf("cpu:           %.2f%% (%.3f s)\n",
+		100.0 * cpu * 1e9 / (end - start), cpu);
+
+	free(lat);
+	free(data);
+
+	return 0;
+}
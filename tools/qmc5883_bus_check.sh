@@ -0,0 +1,400 @@
+#!/bin/sh
+#
+# Regression check for the QMC5883 driver.
+#
+# Copyright (C) 2022 GiraffAI
+#
+# Author: Amarnath Revanna <amarnath.revanna@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# Runs against a probed qmc5883 device and checks what the driver
+# returns as well as what it costs on the bus:
+#
+#  * every value of sampling_frequency_available, scale_available and
+#    oversampling_ratio_available written to the channel attribute reads
+#    back unchanged, and an invalid value is refused;
+#  * raw reads return s16 values;
+#  * config reads and cached raw reads make no I2C transfer, and a
+#    buffered sample on the driver's own trigger costs one 9-byte burst;
+#  * on qmc5883_emul, sysfs and buffered samples match the field the
+#    emulator is programmed with.
+#
+# Loads the driver on top of qmc5883_emul unless a qmc5883 device is
+# already there.
+#
+# I2C transfers are counted with the i2c:i2c_result tracepoint on the
+# sensor's adapter and buffered samples with the driver's debugfs stats.
+# Without debugfs and ftrace those checks are skipped. Needs root to
+# write the attributes. Exits non-zero if any check fails.
+#
+
+IIO_DIR=/sys/bus/iio/devices
+EMUL_PARAMS=/sys/module/qmc5883_emul/parameters
+DEBUGFS=/sys/kernel/debug
+TRACING=$DEBUGFS/tracing
+
+moddir=$(dirname "$0")/..
+name=qmc5883
+devid=
+freq=200
+seconds=3
+failed=0
+checks=0
+tracing=
+loaded=
+emul_saved=
+
+# Field programmed into the emulator, in milligauss
+FIELD_MG="200 -150 400"
+
+usage()
+{
+	cat >&2 <<EOF
+Usage: $0 [options]
+  -m <dir>      directory holding the .ko files (default $moddir)
+  -n <name>     device name (default $name)
+  -d <index>    use iio:device<index> instead of looking up -n
+  -f <hz>       sampling frequency for the buffered check (default $freq)
+  -s <seconds>  buffered capture length (default $seconds)
+EOF
+	exit 2
+}
+
+while getopts "m:n:d:f:s:h" opt; do
+	case $opt in
+	m) moddir=$OPTARG ;;
+	n) name=$OPTARG ;;
+	d) devid=$OPTARG ;;
+	f) freq=$OPTARG ;;
+	s) seconds=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+
+die()
+{
+	echo "error: $*" >&2
+	exit 2
+}
+
+pass()
+{
+	checks=$((checks + 1))
+	echo "PASS: $*"
+}
+
+fail()
+{
+	checks=$((checks + 1))
+	failed=$((failed + 1))
+	echo "FAIL: $*"
+}
+
+check()
+{
+	if [ "$2" = "$3" ]; then
+		pass "$1 ($2)"
+	else
+		fail "$1: got $2, expected $3"
+	fi
+}
+
+# Numeric compare, sysfs prints values in its own precision
+same_value()
+{
+	awk -v a="$1" -v b="$2" 'BEGIN {
+		d = a - b; if (d < 0) d = -d
+		m = a < 0 ? -a : a
+		exit !(a != "" && b != "" && d <= m * 1e-6 + 1e-9)
+	}'
+}
+
+find_device()
+{
+	for dev in "$IIO_DIR"/iio:device*; do
+		[ "$(cat "$dev/name" 2>/dev/null)" = "$name" ] || continue
+		echo "${dev##*iio:device}"
+		return 0
+	done
+	return 1
+}
+
+stat_value()
+{
+	sed -n "s/^$1: //p" "$stats"
+}
+
+# Number of I2C transfers on the sensor's adapter since trace_start
+trace_start()
+{
+	echo 0 > "$TRACING/tracing_on"
+	echo > "$TRACING/trace"
+	echo 1 > "$TRACING/tracing_on"
+}
+
+trace_count()
+{
+	echo 0 > "$TRACING/tracing_on"
+	grep -c "i2c_result: i2c-$adapter " "$TRACING/trace"
+}
+
+check_transfers()
+{
+	if [ -n "$tracing" ]; then
+		check "$1, I2C transfers" "$(trace_count)" 0
+	else
+		echo "SKIP: $1, no i2c tracepoints"
+	fi
+}
+
+# Write each listed value to @attr and read it back
+check_roundtrip()
+{
+	attr=$devdir/$1
+	orig=$(cat "$attr")
+
+	for v in $(cat "$devdir/$2"); do
+		# integer attributes are listed as N.0 by some kernels
+		case $1 in
+		*oversampling_ratio) v=${v%%.*} ;;
+		esac
+		if ! echo "$v" > "$attr" 2>/dev/null; then
+			fail "$1: writing $v refused"
+			continue
+		fi
+		got=$(cat "$attr")
+		if same_value "$got" "$v"; then
+			pass "$1 = $v"
+		else
+			fail "$1: wrote $v, read back $got"
+		fi
+	done
+
+	if echo 12345 > "$attr" 2>/dev/null; then
+		fail "$1: 12345 accepted"
+	else
+		pass "$1: 12345 refused"
+	fi
+	echo "$orig" > "$attr"
+}
+
+check_s16()
+{
+	v=$(cat "$devdir/$1") || { fail "$1: read failed"; return; }
+	case $v in
+	''|*[!0-9-]*) fail "$1: $v is not an integer"; return ;;
+	esac
+	if [ "$v" -ge -32768 ] && [ "$v" -le 32767 ]; then
+		pass "$1 = $v"
+	else
+		fail "$1: $v out of s16 range"
+	fi
+}
+
+# Expected raw value of @mg milligauss at the current scale
+field_raw()
+{
+	# in_magn_scale is in gauss per LSB
+	awk -v mg="$1" -v scale="$(cat "$devdir/in_magn_scale")" \
+		'BEGIN {
+			r = mg / 1000 / scale
+			printf "%d\n", r + (r < 0 ? -0.5 : 0.5)
+		}'
+}
+
+check_field()
+{
+	if [ $(($2 - $3)) -ge -1 ] && [ $(($2 - $3)) -le 1 ]; then
+		pass "$1 = $2"
+	else
+		fail "$1: got $2, expected $3"
+	fi
+}
+
+emul_program()
+{
+	emul_saved="$(cat "$EMUL_PARAMS/offset_mg") \
+		$(cat "$EMUL_PARAMS/amplitude_mg") $(cat "$EMUL_PARAMS/noise_mg")"
+	echo "$FIELD_MG" | tr ' ' ',' > "$EMUL_PARAMS/offset_mg"
+	echo 0 > "$EMUL_PARAMS/amplitude_mg"
+	echo 0 > "$EMUL_PARAMS/noise_mg"
+}
+
+emul_restore()
+{
+	set -- $emul_saved
+	echo "$1" > "$EMUL_PARAMS/offset_mg"
+	echo "$2" > "$EMUL_PARAMS/amplitude_mg"
+	echo "$3" > "$EMUL_PARAMS/noise_mg"
+}
+
+cleanup()
+{
+	[ -n "$devdir" ] && echo 0 > "$devdir/buffer/enable" 2>/dev/null
+	[ -n "$max_age" ] && echo "$max_age" > "$devdir/sample_max_age_ms"
+	if [ -n "$tracing" ]; then
+		echo 0 > "$TRACING/events/i2c/i2c_result/enable"
+		echo 0 > "$TRACING/events/i2c/i2c_result/filter"
+	fi
+	[ -n "$emul_saved" ] && emul_restore
+	for mod in $loaded; do
+		rmmod "$mod"
+	done
+}
+trap cleanup EXIT
+trap 'exit 2' INT TERM
+
+[ "$(id -u)" = 0 ] || die "must run as root"
+
+if [ -z "$devid" ] && ! find_device > /dev/null; then
+	for mod in qmc5883_core qmc5883_i2c; do
+		grep -q "^$mod " /proc/modules && continue
+		insmod "$moddir/$mod.ko" || die "cannot load $mod"
+		loaded="$mod $loaded"
+	done
+	insmod "$moddir/qmc5883_emul.ko" devices=1 ||
+		die "cannot load qmc5883_emul"
+	loaded="qmc5883_emul $loaded"
+	sleep 1
+fi
+
+[ -n "$devid" ] || devid=$(find_device) || die "no IIO device named $name"
+devdir=$IIO_DIR/iio:device$devid
+[ -d "$devdir" ] || die "no IIO device $devid"
+name=$(cat "$devdir/name")
+devnode=/dev/iio:device$devid
+
+# .../i2c-<adapter>/<adapter>-000d/iio:deviceN
+client=$(basename "$(dirname "$(readlink -f "$devdir")")")
+adapter=${client%%-*}
+case $adapter in
+''|*[!0-9]*) die "iio:device$devid does not sit on an I2C adapter" ;;
+esac
+case $(cat "/sys/bus/i2c/devices/i2c-$adapter/name") in
+"qmc5883 emulator"*) emul_program ;;
+esac
+
+grep -q " $DEBUGFS debugfs" /proc/mounts ||
+	mount -t debugfs none "$DEBUGFS" 2>/dev/null
+stats=$DEBUGFS/iio/iio:device$devid/stats
+if [ -d "$TRACING/events/i2c/i2c_result" ]; then
+	echo "adapter_nr == $adapter" > "$TRACING/events/i2c/i2c_result/filter"
+	echo 1 > "$TRACING/events/i2c/i2c_result/enable"
+	tracing=1
+fi
+
+trig=
+for t in "$IIO_DIR"/trigger*; do
+	case $(cat "$t/name") in
+	"$name-dev$devid"|"$name-timer-dev$devid") trig=$(cat "$t/name") ;;
+	esac
+done
+[ -n "$trig" ] || die "no $name trigger for device $devid"
+
+echo 0 > "$devdir/buffer/enable"
+
+check_roundtrip in_magn_sampling_frequency sampling_frequency_available
+check_roundtrip in_magn_scale scale_available
+check_roundtrip in_magn_oversampling_ratio oversampling_ratio_available
+
+# Let runtime PM settle first, suspending the chip is a bus write
+status=$(dirname "$(readlink -f "$devdir")")/power/runtime_status
+i=0
+while [ "$(cat "$status" 2>/dev/null)" = active ] && [ $i -lt 50 ]; do
+	sleep 0.1
+	i=$((i + 1))
+done
+
+[ -n "$tracing" ] && trace_start
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	cat "$devdir/in_magn_sampling_frequency" \
+		"$devdir/in_magn_oversampling_ratio" \
+		"$devdir/in_magn_scale" \
+		"$devdir/sampling_frequency_available" \
+		"$devdir/scale_available" > /dev/null
+done
+check_transfers "config reads"
+
+# The first read may resume the chip and poll, the next ones are cached
+max_age=$(cat "$devdir/sample_max_age_ms")
+echo 1000 > "$devdir/sample_max_age_ms"
+check_s16 in_magn_x_raw
+[ -n "$tracing" ] && trace_start
+cat "$devdir/in_magn_x_raw" "$devdir/in_magn_y_raw" \
+	"$devdir/in_magn_z_raw" > /dev/null
+check_transfers "cached x/y/z reads"
+check_s16 in_magn_y_raw
+check_s16 in_magn_z_raw
+echo "$max_age" > "$devdir/sample_max_age_ms"
+max_age=
+
+if [ ! -r "$stats" ]; then
+	echo "SKIP: buffered bus cost, no $stats"
+else
+	for el in "$devdir"/scan_elements/*_en; do
+		echo 1 > "$el"
+	done
+	echo "$freq" > "$devdir/in_magn_sampling_frequency" ||
+		die "cannot set sampling frequency $freq"
+	echo "$trig" > "$devdir/trigger/current_trigger"
+	echo 256 > "$devdir/buffer/length"
+	echo 1 > "$devdir/buffer/enable" || die "cannot enable buffer"
+
+	# Skip the enable, its flush burst carries no sample
+	sleep 0.5
+	echo 1 > "$DEBUGFS/iio/iio:device$devid/stats_reset"
+	timeout "$seconds" cat "$devnode" > /dev/null
+	echo 0 > "$devdir/buffer/enable"
+
+	samples=$(stat_value samples)
+	[ "${samples:-0}" -gt 0 ] || die "no sample captured with $trig"
+	echo "buffered: $samples samples with $trig"
+	check "buffered transfers_per_sample_x100" \
+		"$(stat_value transfers_per_sample_x100)" 100
+	check "buffered bytes_per_sample_x100" \
+		"$(stat_value bytes_per_sample_x100)" 900
+fi
+
+if [ -z "$emul_saved" ]; then
+	echo "SKIP: field values, not an emulated sensor"
+else
+	set -- $FIELD_MG
+	x=$(field_raw "$1") y=$(field_raw "$2") z=$(field_raw "$3")
+
+	# One conversion at the programmed field, then read it fresh
+	sleep 0.2
+	max_age=$(cat "$devdir/sample_max_age_ms")
+	echo 0 > "$devdir/sample_max_age_ms"
+	check_field "sysfs in_magn_x_raw" "$(cat "$devdir/in_magn_x_raw")" "$x"
+	check_field "sysfs in_magn_y_raw" "$(cat "$devdir/in_magn_y_raw")" "$y"
+	check_field "sysfs in_magn_z_raw" "$(cat "$devdir/in_magn_z_raw")" "$z"
+	echo "$max_age" > "$devdir/sample_max_age_ms"
+	max_age=
+
+	# x, y, z and the timestamp make a 16-byte sample
+	for el in "$devdir"/scan_elements/*_en; do
+		echo 0 > "$el"
+	done
+	for el in in_magn_x_en in_magn_y_en in_magn_z_en in_timestamp_en; do
+		echo 1 > "$devdir/scan_elements/$el"
+	done
+	echo "$trig" > "$devdir/trigger/current_trigger"
+	echo 1 > "$devdir/buffer/enable" || die "cannot enable buffer"
+	set -- $(timeout 2 dd if="$devnode" bs=16 count=1 2>/dev/null |
+		od -An -t d2 -N 6)
+	echo 0 > "$devdir/buffer/enable"
+	if [ $# -ne 3 ]; then
+		fail "no buffered sample with $trig"
+	else
+		check_field "buffered x" "$1" "$x"
+		check_field "buffered y" "$2" "$y"
+		check_field "buffered z" "$3" "$z"
+	fi
+fi
+
+echo "$((checks - failed))/$checks checks passed"
+[ $failed -eq 0 ] || exit 1